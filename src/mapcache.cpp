@@ -0,0 +1,176 @@
+#include <atomic>       // for std::atomic
+#include <cstdio>       // for FILE, fopen, rename
+#include <cstdint>      // for fixed width integers
+#include <cstring>      // for memcpy
+#include <unistd.h>     // for getpid
+
+extern "C" {
+#include "mapreduce.h"
+}
+
+#include "mapcache.h"
+
+// identifies the cache entry format
+static const char magic[4] = { 'M', 'R', 'C', '1' };
+
+// makes the temporary file of each store unique
+static std::atomic<unsigned long> tmp_counter(0);
+
+/**
+ * Appends a length prefixed string to a buffer
+ */
+static void put_string(std::string &buf, const std::string &s) {
+    uint32_t len = s.size();
+    buf.append((const char *) &len, sizeof(len));
+    buf.append(s);
+}
+
+/**
+ * Appends a fixed width integer to a buffer
+ */
+template <typename T>
+static void put_int(std::string &buf, T value) {
+    buf.append((const char *) &value, sizeof(value));
+}
+
+/**
+ * Reads a fixed width integer from a buffer
+ * Returns false if the buffer is too short
+ */
+template <typename T>
+static bool get_int(const std::string &buf, std::size_t &pos, T &value) {
+    if (buf.size() - pos < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, buf.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+/**
+ * Reads a length prefixed string from a buffer
+ * Returns false if the buffer is too short
+ */
+static bool get_string(const std::string &buf, std::size_t &pos, std::string &s) {
+    uint32_t len;
+    if (!get_int(buf, pos, len) || buf.size() - pos < len) {
+        return false;
+    }
+    s.assign(buf.data() + pos, len);
+    pos += len;
+    return true;
+}
+
+/**
+ * Appends the header identifying a file's cache entry to a buffer
+ */
+static void put_header(std::string &buf, MRInput *input, const std::string &mapper_id) {
+    buf.append(magic, sizeof(magic));
+    put_int<uint64_t>(buf, input->size);
+    put_int<int64_t>(buf, input->mtime);
+    put_string(buf, input->file_name);
+    put_string(buf, mapper_id);
+}
+
+MRCache::MRCache(const char *directory, const char *mapper_id) {
+    this->directory = directory;
+    this->mapper_id = (mapper_id != NULL) ? mapper_id : "";
+}
+
+std::string MRCache::entry_path(const char *file_name) {
+    // FNV-1a hash of the path and mapper identity
+    uint64_t hash = 14695981039346656037ULL;
+    std::string id = std::string(file_name) + '\0' + mapper_id;
+    for (unsigned char c : id) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.mrc", (unsigned long long) hash);
+    return directory + name;
+}
+
+bool MRCache::load(MRInput *input) {
+    FILE *fp = fopen(entry_path(input->file_name).c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    // read the whole entry so that nothing is emitted if it is invalid
+    std::string buf;
+    char chunk[64 * 1024];
+    std::size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        buf.append(chunk, n);
+    }
+    fclose(fp);
+
+    // the entry is stale or a hash collision if the header differs
+    std::string header;
+    put_header(header, input, mapper_id);
+    if (buf.compare(0, header.size(), header) != 0) {
+        return false;
+    }
+
+    std::size_t pos = header.size();
+    // every pair takes at least two length prefixes
+    uint64_t count;
+    if (!get_int(buf, pos, count) || count > (buf.size() - pos) / 8) {
+        return false;
+    }
+
+    MRCache::record_t record(count);
+    for (auto &pair : record) {
+        if (!get_string(buf, pos, pair.first) || !get_string(buf, pos, pair.second)) {
+            return false;
+        }
+    }
+
+    for (auto &pair : record) {
+        MR_Emit(&pair.first[0], &pair.second[0]);
+    }
+
+    return true;
+}
+
+bool MRCache::contains(MRInput *input) {
+    FILE *fp = fopen(entry_path(input->file_name).c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    std::string header;
+    put_header(header, input, mapper_id);
+    std::string buf(header.size(), '\0');
+    bool found = fread(&buf[0], 1, buf.size(), fp) == buf.size() && buf == header;
+    fclose(fp);
+
+    return found;
+}
+
+void MRCache::store(MRInput *input, const record_t &record) {
+    std::string buf;
+    put_header(buf, input, mapper_id);
+    put_int<uint64_t>(buf, record.size());
+    for (auto &pair : record) {
+        put_string(buf, pair.first);
+        put_string(buf, pair.second);
+    }
+
+    std::string path = entry_path(input->file_name);
+    std::string tmp = path + ".tmp" + std::to_string(getpid())
+                    + "." + std::to_string(tmp_counter++);
+
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL) {
+        return;
+    }
+
+    bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    ok = (fclose(fp) == 0) && ok;
+
+    // a failed store only costs a cache miss on the next run
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <string>       // for std::string
+#include <utility>      // for std::pair
+#include <vector>       // for std::vector
+
+#include "readahead.h"
+
+/**
+ * On-disk cache of the key-value pairs emitted while mapping each file
+ * An entry is keyed by the file's path, size and modification time and
+ * by a user supplied mapper identity, so unchanged files can be replayed
+ * into the shuffle without calling the Mapper again.
+ */
+struct MRCache {
+    // the key-value pairs emitted while mapping a single file
+    typedef std::vector<std::pair<std::string, std::string>> record_t;
+
+    std::string directory;      // the directory holding the cache entries
+    std::string mapper_id;      // identifies the Mapper that produced them
+
+    MRCache(const char *directory, const char *mapper_id);
+
+    /**
+     * Replays the cached output of a file through MR_Emit
+     * Parameters:
+     *      input - The input file, its size and mtime must be set
+     * Return:
+     *      true  - If a valid entry was found and replayed
+     *      false - If the file must be mapped
+     */
+    bool load(MRInput *input);
+
+    /**
+     * Checks if a file has a valid entry by reading only its header
+     * Parameters:
+     *      input - The input file, its size and mtime must be set
+     * Return:
+     *      true  - If load is expected to replay the file
+     *      false - If the file must be mapped
+     */
+    bool contains(MRInput *input);
+
+    /**
+     * Writes the output of a file to the cache
+     * The entry is written to a temporary file and renamed into place,
+     * so a concurrent or interrupted run never sees a partial entry
+     * Parameters:
+     *      input - The input file, its size and mtime must be set
+     *      record - The key-value pairs emitted while mapping the file
+     */
+    void store(MRInput *input, const record_t &record);
+
+    /**
+     * Gets the path of the cache entry for a file
+     */
+    std::string entry_path(const char *file_name);
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <map>          // for std::multimap
 #include <vector>       // for std::vector
+#include <algorithm>    // for std::sort, std::upper_bound, std::find
 #include <unistd.h>     // for stat syscall
 #include <sys/stat.h>   // for struct stat data type
 #include <pthread.h>    // for mutexes
@@ -11,6 +12,10 @@ extern "C" {
 #include "threadpool.h"
 }
 
+#include "readahead.h"
+#include "mapcache.h"
+#include "trace.h"
+
 /**
  * Exception thrown when MapReduce throws and error it cannot 
  * recover from.
@@ -68,23 +73,585 @@ struct MRData {
     }
 };
 
+/**
+ * Holds the per-key state produced by the Updater function
+ * Each partition is split into stripes, and each stripe is an
+ * open-addressing hash table guarded by its own mutex
+ */
+struct MRTable {
+    // number of stripes per partition, must be a power of two
+    static const std::size_t num_stripes = 16;
+
+    // a single key and its aggregated state
+    struct slot_t {
+        std::string key;        // the key, empty if slot is unused
+        unsigned long hash = 0; // the cached hash of the key
+        void *state = NULL;     // the state returned by the Updater
+        bool used = false;      // is the slot occupied
+    };
+
+    // a linear probing hash table and the mutex protecting it
+    struct stripe_t {
+        pthread_mutex_t mutex;          // mutex for the stripe
+        std::vector<slot_t> slots;      // capacity is a power of two
+        std::size_t size;               // number of used slots
+    };
+
+    std::size_t num_partitions;     // the number of partitions
+    stripe_t *stripe;               // num_partitions * num_stripes stripes
+
+    MRTable(std::size_t n) {
+        num_partitions = n;
+        stripe = new stripe_t[n * num_stripes];
+
+        for (std::size_t i = 0; i < n * num_stripes; i++) {
+            pthread_mutex_init(&stripe[i].mutex, NULL);
+            stripe[i].slots.resize(16);
+            stripe[i].size = 0;
+        }
+    }
+
+    ~MRTable() {
+        for (std::size_t i = 0; i < num_partitions * num_stripes; i++) {
+            pthread_mutex_destroy(&stripe[i].mutex);
+        }
+
+        delete[] stripe;
+    }
+
+    /**
+     * Maps a hash to its home slot using fibonacci hashing
+     * Mixes the high bits in since the low bits select the partition
+     */
+    static std::size_t home(unsigned long hash, std::size_t capacity) {
+        return (hash * 0x9E3779B97F4A7C15ULL >> 32) & (capacity - 1);
+    }
+
+    /**
+     * Finds the slot for a key in a stripe, the slot is unused if the
+     * key is not present. The stripe's mutex must be held.
+     */
+    static slot_t &find(stripe_t &s, const char *key, unsigned long hash) {
+        std::size_t mask = s.slots.size() - 1;
+        std::size_t i = home(hash, s.slots.size());
+
+        while (s.slots[i].used) {
+            if (s.slots[i].hash == hash && s.slots[i].key.compare(key) == 0) {
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+
+        return s.slots[i];
+    }
+
+    /**
+     * Doubles the capacity of a stripe and reinserts every key
+     * The stripe's mutex must be held.
+     */
+    static void grow(stripe_t &s) {
+        std::vector<slot_t> old(s.slots.size() * 2);
+        old.swap(s.slots);
+
+        std::size_t mask = s.slots.size() - 1;
+        for (auto &slot : old) {
+            if (slot.used) {
+                std::size_t i = home(slot.hash, s.slots.size());
+                while (s.slots[i].used) {
+                    i = (i + 1) & mask;
+                }
+                s.slots[i] = std::move(slot);
+            }
+        }
+    }
+
+    /**
+     * Folds a value into the state of a key using the update function
+     */
+    void update(std::size_t partition, const char *key, unsigned long hash,
+                char *value, Updater updater) {
+        stripe_t &s = stripe[partition * num_stripes + (hash >> 8) % num_stripes];
+
+        MR_TraceLock(&s.mutex, "stripe mutex", partition);
+        slot_t *slot = &find(s, key, hash);
+
+        if (!slot->used) {
+            // keep the load factor at or below 3/4
+            if (4 * (s.size + 1) > 3 * s.slots.size()) {
+                grow(s);
+                slot = &find(s, key, hash);
+            }
+
+            slot->key = key;
+            slot->hash = hash;
+            slot->state = NULL;
+            slot->used = true;
+            s.size++;
+        }
+
+        slot->state = updater((char *) slot->key.c_str(), slot->state, value);
+        pthread_mutex_unlock(&s.mutex);
+    }
+};
+
 // MapReduce shared data
 // declared static so it cannot be accessed from other files
 MRData *shared_data;
 
+// Aggregation table, only used by MR_RunAggregate
+MRTable *shared_table;
+
 // Not passed to MR_ProcessPartition
 // so stored as a global variable instead
 Reducer g_reducer;
 
+// Not passed to MR_Emit or MR_ProcessAggregate
+// so stored as global variables instead
+Updater g_updater;
+Aggregator g_aggregator;
+
+// Not passed to Mapper_work
+// so stored as global variables instead
+Mapper g_mapper;
+MRReader *g_reader;
+
+// The max files read but not yet mapped, 0 if read-ahead is disabled
+int g_read_ahead;
+
+// May read-ahead use io_uring
+bool g_use_uring = true;
+
+// The input being mapped by this thread, used by MR_GetInput
+thread_local MRInput *t_input;
+
+// The map output cache, NULL if caching is disabled
+MRCache *g_cache;
+
+// The pairs emitted by this thread's Mapper, NULL if not recording
+thread_local MRCache::record_t *t_record;
+
+// The file traces are written to, empty if tracing is disabled
+std::string g_trace_path;
+
+/**
+ * A single attempt at mapping an input while speculation is enabled
+ * Emitted pairs are staged here and only written to the intermediate
+ * data if this attempt is the first to finish
+ */
+struct MRAttempt {
+    MRInput *input;                 // the input being mapped
+    MRCache::record_t record;       // the pairs emitted by this attempt
+    std::size_t progress;           // bytes consumed, from MR_ReportProgress
+    unsigned long long start;       // when the attempt started
+};
+
+/**
+ * The mapper pool and inputs of a map phase
+ * Kept alive after every input has committed, until any losing
+ * speculative attempts have finished
+ */
+struct MRMapPhase {
+    ThreadPool_t *pool;             // the mapper pool
+    std::vector<MRInput> inputs;    // the input files
+    MRReader *reader;               // the read-ahead reader, or NULL
+};
+
+// Speculative execution state, counters guarded by g_spec_mutex
+static const double spec_slowdown = 2.0;    // how much slower a straggler is
+static const unsigned long long spec_min_ns = 10000000;     // min expected time
+static const unsigned long long spec_poll_ns = 5000000;     // straggler poll
+bool g_speculate;                       // is speculation enabled
+bool g_spec_active;                     // is it enabled for this map phase
+int g_spec_total;                       // inputs in the map phase
+int g_spec_started;                     // inputs with a first attempt started
+int g_spec_finished;                    // inputs committed or missing
+double g_spec_bytes;                    // bytes mapped by committed attempts
+double g_spec_time;                     // time taken by committed attempts
+std::vector<MRAttempt *> g_spec_running;    // attempts in flight
+pthread_mutex_t g_spec_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_spec_cond = PTHREAD_COND_INITIALIZER;
+
+// The attempt being run by this thread, NULL if not speculating
+thread_local MRAttempt *t_attempt;
+
+// A committed map phase whose losing attempts may still be running
+// joined by MR_JoinMap before MR_Run returns
+MRMapPhase *g_lingering;
+
+// The function used by MR_Emit to assign keys to partitions
+Partitioner g_partitioner = MR_Partition;
+
+// Staging used to choose the split points of MR_RangePartition
+// the first pairs of the map phase are held back until the splits are known
+static const std::size_t sample_keys = 64 * 1024;  // pairs staged before splitting
+bool g_splits_ready = true;                 // have the split points been chosen
+MRCache::record_t g_staged;                 // the pairs held back so far
+pthread_mutex_t g_sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Split points of MR_RangePartition in ascending order
+// keys in partition i are less than g_splits[i]
+std::vector<std::string> g_splits;
+
+/**
+ * Computes the DJB2 hash of a key
+ * Parameters:
+ *      key - The key to hash
+ */
+static unsigned long MR_Hash(const char *key) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *key++) != 0) {
+        hash = hash * 33 + c;
+    }
+    return hash;
+}
+
 /**
  * The work function for reducer threads
  * Parameters:
  *      partition_number - A pointer to the parition number argument
  */
 void Reducer_work(int *partition_number) {
+    MRTraceScope scope("task", "reduce", NULL, *partition_number);
     MR_ProcessPartition(*partition_number);
 }
 
+/**
+ * Maps a single input, replaying it from the cache if possible
+ * Records the emitted pairs into the cache otherwise
+ * Parameters:
+ *      input - The input file, its contents have already been read
+ *              if read-ahead is enabled and it was not in the cache
+ */
+void MR_MapInput(MRInput *input) {
+    bool cached = false;
+    if (g_cache != NULL) {
+        MRTraceScope scope("io", "cache load", input->file_name);
+        cached = g_cache->load(input);
+    }
+
+    if (!cached) {
+        MRCache::record_t record;
+        t_record = (g_cache != NULL) ? &record : NULL;
+        t_input = input;
+
+        {
+            MRTraceScope scope("task", "map", input->file_name);
+            g_mapper(input->file_name);
+        }
+
+        t_input = NULL;
+        t_record = NULL;
+
+        if (g_cache != NULL) {
+            MRTraceScope scope("io", "cache store", input->file_name);
+            g_cache->store(input, record);
+        }
+    }
+}
+
+/**
+ * Runs one attempt at mapping an input with its output staged
+ * The first attempt to finish writes its staged pairs to the
+ * intermediate data, later attempts discard theirs
+ * Parameters:
+ *      input - The input file
+ *      backup - Is this a speculative copy of a running attempt
+ */
+void MR_RunAttempt(MRInput *input, bool backup) {
+    MRAttempt attempt;
+    attempt.input = input;
+    attempt.progress = 0;
+    attempt.start = MR_TraceNow();
+
+    // backups are counted by MR_NextStraggler when they are reserved
+    pthread_mutex_lock(&g_spec_mutex);
+    if (!backup) {
+        input->attempts++;
+        input->running++;
+        g_spec_started++;
+    }
+    g_spec_running.push_back(&attempt);
+    pthread_mutex_unlock(&g_spec_mutex);
+
+    // cached pairs are staged like emitted ones
+    t_attempt = &attempt;
+    bool cached = false;
+    if (g_cache != NULL) {
+        MRTraceScope scope("io", "cache load", input->file_name);
+        cached = g_cache->load(input);
+    }
+
+    if (!cached) {
+        MRTraceScope scope("task", backup ? "speculative map" : "map", input->file_name);
+        t_input = input;
+        g_mapper(input->file_name);
+        t_input = NULL;
+    }
+    t_attempt = NULL;
+
+    // the first attempt to finish commits
+    pthread_mutex_lock(&g_spec_mutex);
+    g_spec_running.erase(std::find(g_spec_running.begin(), g_spec_running.end(), &attempt));
+    bool won = !input->committed;
+    if (won) {
+        __atomic_store_n(&input->committed, true, __ATOMIC_RELAXED);
+        g_spec_bytes += input->size;
+        g_spec_time += MR_TraceNow() - attempt.start;
+    }
+    pthread_mutex_unlock(&g_spec_mutex);
+
+    if (won) {
+        {
+            MRTraceScope scope("task", "commit", input->file_name);
+            for (auto &pair : attempt.record) {
+                MR_Emit(&pair.first[0], &pair.second[0]);
+            }
+        }
+
+        if (g_cache != NULL && !cached) {
+            MRTraceScope scope("io", "cache store", input->file_name);
+            g_cache->store(input, attempt.record);
+        }
+    }
+
+    pthread_mutex_lock(&g_spec_mutex);
+    if (won) {
+        g_spec_finished++;
+        pthread_cond_broadcast(&g_spec_cond);
+    }
+    bool last = (--input->running == 0);
+    pthread_mutex_unlock(&g_spec_mutex);
+
+    // the input's buffer is freed once every attempt has finished
+    if (last && g_reader != NULL) {
+        g_reader->release(input);
+    }
+}
+
+/**
+ * Waits for a running input that is worth a speculative attempt
+ * Only inputs with a single attempt are considered, and only once every
+ * input has started. An input is a straggler if its estimated time is
+ * spec_slowdown times more than committed inputs of its size took.
+ * Return:
+ *      MRInput* - The straggler, with its backup attempt reserved
+ *      NULL - If every input has committed or already has a backup
+ */
+MRInput *MR_NextStraggler() {
+    MRInput *straggler = NULL;
+
+    pthread_mutex_lock(&g_spec_mutex);
+    while (g_spec_started == g_spec_total && g_spec_finished < g_spec_total) {
+        unsigned long long now = MR_TraceNow();
+        double worst = spec_slowdown;
+        bool waiting = false;
+
+        for (MRAttempt *attempt : g_spec_running) {
+            MRInput *input = attempt->input;
+            if (input->committed || input->attempts > 1) {
+                continue;
+            }
+            waiting = true;
+
+            // no rate to compare against until an input has committed
+            if (g_spec_time == 0) {
+                continue;
+            }
+
+            // the time committed inputs of the same size took
+            double expected = (g_spec_bytes > 0) ? input->size * g_spec_time / g_spec_bytes : 0;
+            expected = std::max(expected, (double) spec_min_ns);
+
+            // extrapolate the total time from the reported progress
+            double elapsed = now - attempt->start;
+            std::size_t progress = __atomic_load_n(&attempt->progress, __ATOMIC_RELAXED);
+            double estimated = elapsed;
+            if (progress > 0 && progress < input->size) {
+                estimated = elapsed * input->size / progress;
+            }
+
+            if (estimated / expected > worst) {
+                worst = estimated / expected;
+                straggler = input;
+            }
+        }
+
+        if (straggler != NULL) {
+            // count the backup as running now, so the original attempt
+            // cannot release the input's buffer before the backup starts
+            straggler->attempts++;
+            straggler->running++;
+            break;
+        }
+        if (!waiting) {
+            break;
+        }
+
+        // check again once the running attempts have made progress
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += spec_poll_ns;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&g_spec_cond, &g_spec_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&g_spec_mutex);
+
+    return straggler;
+}
+
+/**
+ * The work function for mapper threads
+ * Parameters:
+ *      input - The input file, its contents have already been read
+ *              if read-ahead is enabled
+ */
+void Mapper_work(MRInput *input) {
+    // missing files are disregarded, like MR_Map does without read-ahead
+    if (input->missing) {
+        if (g_spec_active) {
+            pthread_mutex_lock(&g_spec_mutex);
+            g_spec_started++;
+            g_spec_finished++;
+            pthread_cond_broadcast(&g_spec_cond);
+            pthread_mutex_unlock(&g_spec_mutex);
+        }
+        g_reader->release(input);
+        return;
+    }
+
+    if (!g_spec_active) {
+        MR_MapInput(input);
+        if (g_reader != NULL) {
+            g_reader->release(input);
+        }
+        return;
+    }
+
+    MR_RunAttempt(input, false);
+
+    // this mapper is idle, back up stragglers until all have committed
+    MRInput *straggler;
+    while ((straggler = MR_NextStraggler()) != NULL) {
+        MR_RunAttempt(straggler, true);
+    }
+}
+
+/**
+ * Starts tracking the inputs of a map phase for speculative execution
+ * Parameters:
+ *      num_inputs - The number of inputs that will be pushed to Mapper_work
+ */
+void MR_StartSpeculation(int num_inputs) {
+    g_spec_active = g_speculate;
+    g_spec_total = num_inputs;
+    g_spec_started = 0;
+    g_spec_finished = 0;
+    g_spec_bytes = 0;
+    g_spec_time = 0;
+}
+
+/**
+ * Waits for every input of a map phase to commit
+ * Without speculation the mapper pool is destroyed. With speculation the
+ * phase lingers so losing attempts can finish alongside the reducers,
+ * and MR_JoinMap is called once the reduce phase is done.
+ * Parameters:
+ *      phase - The map phase to finish
+ */
+void MR_FinishMap(MRMapPhase *phase) {
+    if (g_spec_active) {
+        pthread_mutex_lock(&g_spec_mutex);
+        while (g_spec_finished < g_spec_total) {
+            pthread_cond_wait(&g_spec_cond, &g_spec_mutex);
+        }
+        pthread_mutex_unlock(&g_spec_mutex);
+
+        g_lingering = phase;
+        return;
+    }
+
+    ThreadPool_destroy(phase->pool);
+    delete phase->reader;
+    g_reader = NULL;
+    delete phase;
+}
+
+/**
+ * Waits for any losing attempts of the last map phase to finish
+ * Their emitted pairs are dropped, so they never touch shared data
+ */
+void MR_JoinMap() {
+    if (g_lingering != NULL) {
+        ThreadPool_destroy(g_lingering->pool);
+        delete g_lingering->reader;
+        g_reader = NULL;
+        delete g_lingering;
+        g_lingering = NULL;
+    }
+    g_spec_active = false;
+}
+
+/**
+ * The work function for reducer threads in aggregation mode
+ * Parameters:
+ *      partition_number - A pointer to the parition number argument
+ */
+void Aggregator_work(int *partition_number) {
+    MRTraceScope scope("task", "aggregate", NULL, *partition_number);
+    MR_ProcessAggregate(*partition_number);
+}
+
+/**
+ * Checks if an input is in the cache, so read-ahead can skip reading it
+ * Parameters:
+ *      input - The input file, its size and mtime have been set
+ */
+static bool MR_CacheHit(MRInput *input) {
+    MRTraceScope scope("io", "cache check", input->file_name);
+    return g_cache->contains(input);
+}
+
+/**
+ * Map the given files with their contents read ahead of the mappers
+ * Files are not sorted by size, since that would require a blocking
+ * stat of every file before any work could start
+ * Parameters
+ *      num_files - The number of files in filenames
+ *      filenames - The array of files to processes
+ *      map - The Mapper function to be applied to each file
+ *      num_mappers - The number of mapper threads to create
+ */
+void MR_MapReadAhead(int num_files, char *filenames[], Mapper map, int num_mappers) {
+    MRTraceScope scope("phase", "map");
+
+    MRMapPhase *phase = new MRMapPhase();
+    phase->inputs.resize(num_files);
+    for (int i = 0; i < num_files; i++) {
+        phase->inputs[i].file_name = filenames[i];
+    }
+
+    phase->pool = ThreadPool_create(num_mappers);
+    if (phase->pool == NULL) {
+        throw MapReduceException("Failed to create Mapper Pool");
+    }
+
+    // store in globals
+    g_mapper = map;
+    g_reader = phase->reader = new MRReader(g_read_ahead);
+    g_reader->use_uring = g_use_uring;
+    if (g_cache != NULL) {
+        g_reader->skip = MR_CacheHit;
+    }
+
+    MR_StartSpeculation(num_files);
+    if (!g_reader->run(phase->inputs, phase->pool, (thread_func_t) Mapper_work)) {
+        throw MapReduceException("Failed to read ahead the input files");
+    }
+    MR_FinishMap(phase);
+}
+
 /**
  * Map the given files to intermediate key-value pairs
  * Parameters
@@ -94,62 +661,179 @@ void Reducer_work(int *partition_number) {
  *      num_mappers - The number of mapper threads to create
  */
 void MR_Map(int num_files, char *filenames[], Mapper map, int num_mappers) {
-    // sort files by size in ascending order
-    std::multimap<int, const char *> sorted_files;
+    if (g_read_ahead > 0) {
+        MR_MapReadAhead(num_files, filenames, map, num_mappers);
+        return;
+    }
+
+    MRTraceScope scope("phase", "map");
+
+    MRMapPhase *phase = new MRMapPhase();
+    phase->reader = NULL;
 
     for (int i = 0; i < num_files; i++) {
         // if the file does not exist, disregard it
         struct stat statbuf;
         if (stat(filenames[i], &statbuf) == 0) {
-            sorted_files.emplace(statbuf.st_size, filenames[i]);
+            MRInput input = MRInput();
+            input.file_name = filenames[i];
+            input.size = statbuf.st_size;
+            input.mtime = statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+            phase->inputs.push_back(input);
         }
     }
 
-    ThreadPool_t *mapperPool = ThreadPool_create(num_mappers);
-    if (mapperPool == NULL) {
+    // sort files by size in descending order
+    std::stable_sort(phase->inputs.begin(), phase->inputs.end(),
+        [](const MRInput &a, const MRInput &b) {
+            return a.size > b.size;
+        });
+
+    // store in global
+    g_mapper = map;
+
+    // bound the work queue so it does not grow with the number of files
+    phase->pool = ThreadPool_create_bounded(num_mappers, 4 * num_mappers, true);
+    if (phase->pool == NULL) {
         throw MapReduceException("Failed to create Mapper Pool");
     }
 
     // push the files into the work queue in descending order
-    for (auto i = sorted_files.rbegin(); i != sorted_files.rend(); i++) {
-        if(!ThreadPool_add_work(mapperPool, (thread_func_t) map, (void *) i->second)) {
-            throw MapReduceException("Failed to add work to ThreadPool");
-        }
+    std::vector<void *> args;
+    for (auto &input : phase->inputs) {
+        args.push_back(&input);
+    }
+    int num_args = args.size();
+    MR_StartSpeculation(num_args);
+    if (ThreadPool_add_work_batch(phase->pool, (thread_func_t) Mapper_work, args.data(), num_args) != num_args) {
+        throw MapReduceException("Failed to add work to ThreadPool");
     }
 
-    ThreadPool_destroy(mapperPool);
+    MR_FinishMap(phase);
 }
 
 /**
  * Reduce the intermediate key-value pairs to the output
  * Parameters:
- *      reducer - The Reducer function to apply to the intermediate data
+ *      work - The work function run once for each partition
  *      num_reducers - The number of reducer threads to create
  */
-void MR_Reduce(Reducer reducer, int num_reducers) {
-    // store in global
-    g_reducer = reducer;
+void MR_Reduce(thread_func_t work, int num_reducers) {
+    MRTraceScope scope("phase", "reduce");
 
-    // TODO 
-    
     // store args on the heap to they can be passed to workers
     int *args = new int[num_reducers];
+    std::vector<void *> arg_ptrs(num_reducers);
+    for (int i = 0; i < num_reducers; i++) {
+        args[i] = i;
+        arg_ptrs[i] = &args[i];
+    }
+
     ThreadPool_t *reducerPool = ThreadPool_create(num_reducers);
     if (reducerPool == NULL) {
         throw MapReduceException("Failed to create Reducer Pool");
     }
     
-    for (int i = 0; i < num_reducers; i++) {
-        args[i] = i;
-        if (!ThreadPool_add_work(reducerPool, (thread_func_t) Reducer_work, &args[i])) {
-            throw MapReduceException("Failed to add work to Reducer Pool");
-        }
+    if (ThreadPool_add_work_batch(reducerPool, work, arg_ptrs.data(), num_reducers) != num_reducers) {
+        throw MapReduceException("Failed to add work to Reducer Pool");
     }
     
     ThreadPool_destroy(reducerPool);
     delete[] args;
 }
 
+/**
+ * Starts recording trace events if tracing is enabled
+ */
+static void MR_StartTrace() {
+    if (!g_trace_path.empty()) {
+        MR_TraceBegin();
+        ThreadPool_set_trace(MR_TraceWait);
+    }
+}
+
+/**
+ * Writes the recorded trace events if tracing is enabled
+ */
+static void MR_StopTrace() {
+    if (!g_trace_path.empty()) {
+        ThreadPool_set_trace(NULL);
+        MR_TraceEnd(g_trace_path.c_str());
+    }
+}
+
+/**
+ * Stores a key-value pair in its partition
+ * Parameters:
+ *      key - The key to store
+ *      value - The value to associate to that key
+ */
+static void MR_Store(char *key, char *value) {
+    // in aggregation mode fold the value in place instead of storing it
+    if (g_updater != NULL) {
+        unsigned long hash = MR_Hash(key);
+        std::size_t index = g_partitioner(key, shared_table->num_partitions);
+        shared_table->update(index, key, hash, value, g_updater);
+        return;
+    }
+
+    // determines the index using the partition function
+    std::size_t index = g_partitioner(key, shared_data->num_partitions);
+    
+    // aquire lock before modiyfing data
+    MR_TraceLock(&shared_data->mutex[index], "partition mutex", index);
+    shared_data->partition[index].emplace(key, value);
+    pthread_mutex_unlock(&shared_data->mutex[index]);
+}
+
+/**
+ * Chooses the split points used by MR_RangePartition
+ * Splits the sorted keys of the staged pairs into equal ranges, then
+ * stores the staged pairs. Must be called with g_sample_mutex held
+ */
+static void MR_ChooseSplits() {
+    MRTraceScope scope("phase", "sample");
+
+    int num_partitions = (g_updater != NULL) ? shared_table->num_partitions
+                                             : shared_data->num_partitions;
+
+    std::vector<const std::string *> keys;
+    keys.reserve(g_staged.size());
+    for (auto &pair : g_staged) {
+        keys.push_back(&pair.first);
+    }
+    std::sort(keys.begin(), keys.end(),
+        [](const std::string *a, const std::string *b) {
+            return *a < *b;
+        });
+
+    g_splits.clear();
+    if (!keys.empty()) {
+        for (int i = 1; i < num_partitions; i++) {
+            g_splits.push_back(*keys[i * keys.size() / num_partitions]);
+        }
+    }
+
+    // later pairs skip the staging once the splits are visible
+    __atomic_store_n(&g_splits_ready, true, __ATOMIC_RELEASE);
+
+    for (auto &pair : g_staged) {
+        MR_Store(&pair.first[0], &pair.second[0]);
+    }
+    MRCache::record_t().swap(g_staged);
+}
+
+/**
+ * Stores the staged pairs if the map phase emitted too few to split
+ */
+static void MR_FlushStaged() {
+    pthread_mutex_lock(&g_sample_mutex);
+    if (!g_splits_ready) {
+        MR_ChooseSplits();
+    }
+    pthread_mutex_unlock(&g_sample_mutex);
+}
+
 /**
  * Executes the MapReduce workflow
  * Parameters:
@@ -164,13 +848,59 @@ void MR_Run(int num_files, char *filenames[],
             Mapper map, int num_mappers,
             Reducer concate, int num_reducers) {
     shared_data = new MRData(num_reducers);
+    MR_StartTrace();
 
+    g_splits_ready = (g_partitioner != MR_RangePartition);
     MR_Map(num_files, filenames, map, num_mappers);
-    MR_Reduce(concate, num_reducers);
+    MR_FlushStaged();
 
+    // store in global
+    g_reducer = concate;
+    MR_Reduce((thread_func_t) Reducer_work, num_reducers);
+
+    // losing speculative attempts must not outlive the run
+    MR_JoinMap();
+
+    MR_StopTrace();
     delete shared_data;
 }
 
+/**
+ * Executes the MapReduce workflow in aggregation mode
+ * Parameters:
+ *      num_files - The length of the filenames array
+ *      filenames - The array of files to processed
+ *      map - The map function to apply to each file
+ *      num_mappers - The number of mapper threads
+ *      update - Folds a value into the state of its key
+ *      aggregate - Called once per key with its final state
+ *      num_reducers - The number of reducer threads
+ */
+void MR_RunAggregate(int num_files, char *filenames[],
+                     Mapper map, int num_mappers,
+                     Updater update, Aggregator aggregate,
+                     int num_reducers) {
+    shared_table = new MRTable(num_reducers);
+    MR_StartTrace();
+
+    // MR_Emit folds into the table while an Updater is set
+    g_updater = update;
+    g_splits_ready = (g_partitioner != MR_RangePartition);
+    MR_Map(num_files, filenames, map, num_mappers);
+    MR_FlushStaged();
+
+    g_aggregator = aggregate;
+    MR_Reduce((thread_func_t) Aggregator_work, num_reducers);
+
+    // losing speculative attempts must not outlive the run
+    MR_JoinMap();
+
+    MR_StopTrace();
+    g_updater = NULL;
+    delete shared_table;
+    shared_table = NULL;
+}
+
 /**
  * Writes a key-value pair to a partition
  * Parameters:
@@ -178,13 +908,35 @@ void MR_Run(int num_files, char *filenames[],
  *      value - The value to associate to that key
  */
 void MR_Emit(char *key, char *value) {
-    // determines the index using the hash function in MR_Partition
-    std::size_t index = MR_Partition(key, shared_data->num_partitions);
-    
-    // aquire lock before modiyfing data
-    pthread_mutex_lock(&shared_data->mutex[index]);
-    shared_data->partition[index].emplace(key, value);
-    pthread_mutex_unlock(&shared_data->mutex[index]);
+    // stage the pair until the attempt commits
+    // drop it if another attempt has already committed
+    if (t_attempt != NULL) {
+        if (!__atomic_load_n(&t_attempt->input->committed, __ATOMIC_RELAXED)) {
+            t_attempt->record.emplace_back(key, value);
+        }
+        return;
+    }
+
+    // record the pair so the file can be replayed on the next run
+    if (t_record != NULL) {
+        t_record->emplace_back(key, value);
+    }
+
+    // range partitioning holds back the first pairs until the splits are chosen
+    if (!__atomic_load_n(&g_splits_ready, __ATOMIC_ACQUIRE)) {
+        MR_TraceLock(&g_sample_mutex, "sample mutex", -1);
+        if (!g_splits_ready) {
+            g_staged.emplace_back(key, value);
+            if (g_staged.size() >= sample_keys) {
+                MR_ChooseSplits();
+            }
+            pthread_mutex_unlock(&g_sample_mutex);
+            return;
+        }
+        pthread_mutex_unlock(&g_sample_mutex);
+    }
+
+    MR_Store(key, value);
 }
 
 /**
@@ -195,12 +947,116 @@ void MR_Emit(char *key, char *value) {
  *      num_partitions - The total number of partitions
  */
 unsigned long MR_Partition(char *key, int num_partitions) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *key++) != 0) {
-        hash = hash * 33 + c;
+    return MR_Hash(key) % num_partitions;
+}
+
+/**
+ * Sets the function used to assign keys to partitions
+ * Parameters:
+ *      partitioner - The partition function, NULL restores MR_Partition
+ */
+void MR_SetPartitioner(Partitioner partitioner) {
+    g_partitioner = (partitioner != NULL) ? partitioner : MR_Partition;
+}
+
+/**
+ * Assigns a key to a partition using the split points chosen by MR_ChooseSplits
+ * Parameters:
+ *      key - The key to assign
+ *      num_partitions - The total number of partitions
+ */
+unsigned long MR_RangePartition(char *key, int num_partitions) {
+    // the number of split points less than or equal to the key
+    auto it = std::upper_bound(g_splits.begin(), g_splits.end(), key,
+        [](const char *k, const std::string &split) {
+            return split.compare(k) > 0;
+        });
+    return (it - g_splits.begin()) % num_partitions;
+}
+
+/**
+ * Enables reading input files ahead of the mapper threads
+ * Parameters:
+ *      max_in_flight - The max number of files read but not yet mapped
+ */
+void MR_SetReadAhead(int max_in_flight) {
+    g_read_ahead = (max_in_flight > 0) ? max_in_flight : 0;
+}
+
+/**
+ * Chooses whether read-ahead may use io_uring
+ * Parameters:
+ *      enabled - Non-zero to use io_uring when supported
+ */
+void MR_SetUring(int enabled) {
+    g_use_uring = (enabled != 0);
+}
+
+/**
+ * Gets the contents of the file being mapped by the calling mapper
+ * Parameters:
+ *      size - Set to the number of bytes in the file
+ */
+char *MR_GetInput(size_t *size) {
+    if (t_input == NULL) {
+        return NULL;
+    }
+
+    *size = t_input->size;
+    return t_input->buffer;
+}
+
+/**
+ * Enables caching the output of the Mapper for each input file
+ * Parameters:
+ *      directory - An existing directory to store the cache in
+ *      mapper_id - Identifies the Mapper
+ */
+void MR_SetCache(const char *directory, const char *mapper_id) {
+    delete g_cache;
+    g_cache = (directory != NULL) ? new MRCache(directory, mapper_id) : NULL;
+}
+
+/**
+ * Enables tracing of tasks, lock waits and phases
+ * Parameters:
+ *      path - The file to write the trace to
+ */
+void MR_SetTrace(const char *path) {
+    g_trace_path = (path != NULL) ? path : "";
+}
+
+/**
+ * Enables speculative execution of straggling map tasks
+ * Parameters:
+ *      enabled - Non-zero to enable speculation
+ */
+void MR_SetSpeculation(int enabled) {
+    g_speculate = (enabled != 0);
+}
+
+/**
+ * Reports how much of its file the calling mapper has consumed
+ * Parameters:
+ *      bytes - The number of bytes of the file consumed so far
+ */
+void MR_ReportProgress(size_t bytes) {
+    if (t_attempt != NULL) {
+        __atomic_store_n(&t_attempt->progress, bytes, __ATOMIC_RELAXED);
     }
-    return hash % num_partitions;
+}
+
+/**
+ * Checks if the calling mapper's attempt has been superseded
+ * Return:
+ *      1 - If another attempt at the file has committed
+ *      0 - Otherwise
+ */
+int MR_Cancelled(void) {
+    if (t_attempt == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&t_attempt->input->committed, __ATOMIC_RELAXED) ? 1 : 0;
 }
 
 /**
@@ -227,6 +1083,36 @@ void MR_ProcessPartition(int partition_number) {
     }
 }
 
+/**
+ * Processes a partition of the aggregation table using the aggregate function
+ * Keys are passed in sorted order to match MR_ProcessPartition
+ * Parameters:
+ *      partition_number - The partition to process
+ */
+void MR_ProcessAggregate(int partition_number) {
+    typedef MRTable::slot_t slot_t;
+    std::vector<slot_t *> slots;
+
+    // collect the used slots from every stripe of the partition
+    // no lock is required since mapping has finished
+    for (std::size_t i = 0; i < MRTable::num_stripes; i++) {
+        auto &stripe = shared_table->stripe[partition_number * MRTable::num_stripes + i];
+        for (auto &slot : stripe.slots) {
+            if (slot.used) {
+                slots.push_back(&slot);
+            }
+        }
+    }
+
+    std::sort(slots.begin(), slots.end(), [](const slot_t *a, const slot_t *b) {
+        return a->key < b->key;
+    });
+
+    for (slot_t *slot : slots) {
+        g_aggregator((char *) slot->key.c_str(), slot->state, partition_number);
+    }
+}
+
 /**
  * Gets the next value for that key from the given partition
  * Parameters:
@@ -1,9 +1,14 @@
 #ifndef MAPREDUCE_H
 #define MAPREDUCE_H
 
+#include <stddef.h>     // for size_t
+
 // function pointer types used by library functions
 typedef void (*Mapper)(char *file_name);
 typedef void (*Reducer)(char *key, int partition_number);
+typedef void *(*Updater)(char *key, void *state, char *value);
+typedef void (*Aggregator)(char *key, void *state, int partition_number);
+typedef unsigned long (*Partitioner)(char *key, int num_partitions);
 
 /**
  * Executes MapReduce
@@ -19,6 +24,26 @@ void MR_Run(int num_files, char *filenames[],
             Mapper map, int num_mappers,
             Reducer concate, int num_reducers);
 
+/**
+ * Executes MapReduce in aggregation mode
+ * Emitted values are folded into a per-key state by the update function
+ * instead of being stored, so memory grows with the number of distinct
+ * keys rather than the number of emitted pairs
+ * Parameters:
+ *      num_files - The length of the filenames array
+ *      filenames - The array of files to processed
+ *      map - The map function to apply to each file
+ *      num_mappers - The number of mapper threads
+ *      update - Folds a value into the state of its key, returns the new
+ *               state (state is NULL for the first value of a key)
+ *      aggregate - Called once per key with its final state
+ *      num_reducers - The number of reducer threads
+ */
+void MR_RunAggregate(int num_files, char *filenames[],
+                     Mapper map, int num_mappers,
+                     Updater update, Aggregator aggregate,
+                     int num_reducers);
+
 /**
  * Writes a key-value pair to a partition
  * Parameters:
@@ -36,6 +61,109 @@ void MR_Emit(char *key, char *value);
  */
 unsigned long MR_Partition(char *key, int num_partitions);
 
+/**
+ * Sets the function used to assign keys to partitions
+ * Must be called before MR_Run or MR_RunAggregate
+ * Parameters:
+ *      partitioner - The partition function, NULL restores MR_Partition
+ */
+void MR_SetPartitioner(Partitioner partitioner);
+
+/**
+ * Assigns a key to a partition using split points sampled from the input
+ * Partition i only holds keys smaller than the keys in partition i + 1,
+ * so concatenating the reducer outputs in order yields sorted output
+ * Parameters:
+ *      key - The key to assign
+ *      num_partitions - The total number of partitions
+ */
+unsigned long MR_RangePartition(char *key, int num_partitions);
+
+/**
+ * Enables reading input files ahead of the mapper threads
+ * Files are opened and read asynchronously (using io_uring when available)
+ * and only handed to a mapper once their contents are in memory
+ * Must be called before MR_Run or MR_RunAggregate
+ * Parameters:
+ *      max_in_flight - The max number of files read but not yet mapped,
+ *                      0 disables read-ahead
+ */
+void MR_SetReadAhead(int max_in_flight);
+
+/**
+ * Chooses whether read-ahead may use io_uring
+ * Without it a pool of reader threads does blocking reads, which is
+ * useful where io_uring is available but not permitted
+ * Must be called before MR_Run or MR_RunAggregate
+ * Parameters:
+ *      enabled - Non-zero to use io_uring when supported, the default
+ */
+void MR_SetUring(int enabled);
+
+/**
+ * Gets the contents of the file being mapped by the calling mapper
+ * The buffer is NUL terminated and is freed once the Mapper returns
+ * Parameters:
+ *      size - Set to the number of bytes in the file
+ * Return:
+ *      The file contents, or NULL if read-ahead is disabled
+ */
+char *MR_GetInput(size_t *size);
+
+/**
+ * Enables caching the output of the Mapper for each input file
+ * Files whose path, size and modification time match a cache entry
+ * written by the same mapper are replayed from the cache instead of
+ * being mapped again
+ * Must be called before MR_Run or MR_RunAggregate
+ * Parameters:
+ *      directory - An existing directory to store the cache in,
+ *                  NULL disables the cache
+ *      mapper_id - Identifies the Mapper, change it whenever the
+ *                  Mapper's output would change
+ */
+void MR_SetCache(const char *directory, const char *mapper_id);
+
+/**
+ * Enables tracing of tasks, lock waits and phases
+ * The events of each run are written to a Chrome trace JSON file, which
+ * can be opened in chrome://tracing or Perfetto
+ * Must be called before MR_Run or MR_RunAggregate
+ * Parameters:
+ *      path - The file to write the trace to, NULL disables tracing
+ */
+void MR_SetTrace(const char *path);
+
+/**
+ * Enables speculative execution of straggling map tasks
+ * Once every file has been handed to a mapper, idle mappers start a
+ * second attempt of the slowest running files. Emitted pairs are staged
+ * per attempt and only the first attempt to finish is kept, so the Mapper
+ * must not have side effects other than calling MR_Emit
+ * Must be called before MR_Run or MR_RunAggregate
+ * Parameters:
+ *      enabled - Non-zero to enable speculation, 0 to disable it
+ */
+void MR_SetSpeculation(int enabled);
+
+/**
+ * Reports how much of its file the calling mapper has consumed
+ * Used to pick which files to speculatively map, optional
+ * Parameters:
+ *      bytes - The number of bytes of the file consumed so far
+ */
+void MR_ReportProgress(size_t bytes);
+
+/**
+ * Checks if the calling mapper's attempt has been superseded
+ * Another attempt at the same file has committed, so the pairs emitted
+ * from now on are dropped and the Mapper may return early
+ * Return:
+ *      1 - If the Mapper should stop mapping its file
+ *      0 - Otherwise, including when speculation is disabled
+ */
+int MR_Cancelled(void);
+
 /**
  * Processes a partition using the reducer function
  * Parameters:
@@ -43,6 +171,13 @@ unsigned long MR_Partition(char *key, int num_partitions);
  */
 void MR_ProcessPartition(int partition_number);
 
+/**
+ * Processes a partition of the aggregation table using the aggregate function
+ * Parameters:
+ *      partition_number - The partition to process
+ */
+void MR_ProcessAggregate(int partition_number);
+
 /**
  * Gets the next value for that key from the given partition
  * Parameters:
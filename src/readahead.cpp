@@ -0,0 +1,679 @@
+#include <algorithm>        // for std::min, std::max
+#include <cstdint>          // for uint64_t
+#include <cstring>          // for memset
+#include <cerrno>           // for errno
+#include <fcntl.h>          // for open, AT_FDCWD
+#include <unistd.h>         // for read, close, syscall
+#include <sys/mman.h>       // for mmap
+#include <sys/resource.h>   // for getrlimit
+#include <sys/eventfd.h>    // for eventfd
+#include <sys/syscall.h>    // for io_uring syscall numbers
+#include <linux/io_uring.h> // for io_uring structures
+
+#include "readahead.h"
+#include "trace.h"
+
+// the max bytes requested by a single read, the kernel returns a short
+// read for larger requests anyway and io_uring lengths are only 32 bits
+static const std::size_t max_read = 1u << 30;
+
+// tags stored in the low bits of each io_uring request's user_data
+// MRInput and the eventfd counter are 8 byte aligned so their low bits
+// are always zero
+enum {
+    OP_STATX = 0,
+    OP_OPENAT = 1,
+    OP_READ = 2,
+    OP_CLOSE = 3,
+    OP_WAKE = 4,
+    OP_MASK = 7
+};
+
+/**
+ * A minimal io_uring submission and completion queue
+ * Uses the raw syscalls so that no liburing dependency is required
+ */
+struct Uring {
+    int fd = -1;                // the io_uring file descriptor
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;         // the submission queue entries
+    io_uring_cqe *cqes;         // the completion queue entries
+    unsigned sq_entries;        // the capacity of the submission queue
+    unsigned to_submit = 0;     // entries queued but not yet submitted
+    bool failed = false;        // did io_uring_enter fail
+    io_uring_sqe discarded;     // handed out once failed, never submitted
+
+    void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED, *sqes_ptr = MAP_FAILED;
+    std::size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+
+    ~Uring() {
+        if (sqes_ptr != MAP_FAILED) {
+            munmap(sqes_ptr, sqes_len);
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_len);
+        }
+        if (sq_ptr != MAP_FAILED) {
+            munmap(sq_ptr, sq_len);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    /**
+     * Creates the rings and checks the required operations are supported
+     * Parameters:
+     *      entries - The minimum size of the submission queue
+     * Return:
+     *      true  - If io_uring can be used
+     *      false - Otherwise
+     */
+    bool setup(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            return false;
+        }
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+
+        sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            return false;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr = sq_ptr;
+        }
+        else {
+            cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                return false;
+            }
+        }
+
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ptr = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED) {
+            return false;
+        }
+
+        char *sq = (char *) sq_ptr, *cq = (char *) cq_ptr;
+        sq_tail = (unsigned *) (sq + params.sq_off.tail);
+        sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + params.sq_off.array);
+        cq_head = (unsigned *) (cq + params.cq_off.head);
+        cq_tail = (unsigned *) (cq + params.cq_off.tail);
+        cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+        sqes = (io_uring_sqe *) sqes_ptr;
+        sq_entries = params.sq_entries;
+
+        return supports(IORING_OP_STATX) && supports(IORING_OP_OPENAT)
+            && supports(IORING_OP_READ) && supports(IORING_OP_CLOSE);
+    }
+
+    /**
+     * Checks if the kernel supports an io_uring operation
+     * Parameters:
+     *      op - The IORING_OP_* operation to check
+     */
+    bool supports(int op) {
+        std::size_t len = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        std::vector<char> buf(len, 0);
+        io_uring_probe *probe = (io_uring_probe *) buf.data();
+
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            return false;
+        }
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    /**
+     * Gets the next free submission queue entry, submitting if full
+     * Once the ring has failed the entry is discarded instead
+     */
+    io_uring_sqe *get_sqe() {
+        if (to_submit == sq_entries && !enter(0)) {
+            return &discarded;
+        }
+
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    /**
+     * Submits queued entries and waits for completions
+     * Parameters:
+     *      min_complete - The number of completions to wait for
+     * Return:
+     *      true  - If every queued entry was submitted
+     *      false - If io_uring_enter failed, and failed is set
+     */
+    bool enter(unsigned min_complete) {
+        unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (!failed) {
+            int ret = (int) syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, NULL, 0);
+            if (ret >= 0) {
+                to_submit -= std::min((unsigned) ret, to_submit);
+                if (to_submit == 0) {
+                    return true;
+                }
+            }
+            else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                failed = true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * Reads the rest of a file into its buffer using blocking syscalls
+ * Parameters:
+ *      input - The input to read, its file must be open
+ */
+static void read_blocking(MRInput *input) {
+    while (input->offset < input->size) {
+        ssize_t n = read(input->fd, input->buffer + input->offset,
+                         std::min(input->size - input->offset, max_read));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n < 0) {
+            input->unread = true;
+            return;
+        }
+        if (n == 0) {
+            // the file shrank since it was sized
+            input->size = input->offset;
+        }
+        input->offset += n;
+    }
+}
+
+/**
+ * The work function for reader threads when io_uring is not available
+ * Parameters:
+ *      input - The input to open and read
+ */
+static void Reader_work(MRInput *input);
+
+/**
+ * The work function for checking if an input can be skipped
+ * Parameters:
+ *      input - The open and sized input to check
+ */
+static void Check_work(MRInput *input);
+
+// the reader whose inputs Reader_work and Check_work are handling
+static MRReader *g_pool_reader;
+
+MRReader::MRReader(int max_in_flight) {
+    this->max_in_flight = max_in_flight;
+    in_flight = 0;
+
+    // every file in flight may hold a descriptor, so leave at least half
+    // of them to the mappers and the rest of the process
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        long max_open = std::max(1L, (long) limit.rlim_cur / 2);
+        this->max_in_flight = (int) std::min((long) max_in_flight, max_open);
+    }
+
+    skip = NULL;
+    failed = false;
+    use_uring = true;
+    wake_fd = -1;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&not_full, NULL);
+}
+
+MRReader::~MRReader() {
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&not_full);
+}
+
+bool MRReader::run(std::vector<MRInput> &inputs, ThreadPool_t *mapper_pool,
+                   thread_func_t map_work) {
+    this->mapper_pool = mapper_pool;
+    this->map_work = map_work;
+
+    for (auto &input : inputs) {
+        input.buffer = NULL;
+        input.size = 0;
+        input.mtime = 0;
+        input.offset = 0;
+        input.fd = -1;
+        input.pending = 0;
+        input.missing = false;
+        input.unread = false;
+        input.skipped = false;
+        input.attempts = 0;
+        input.running = 0;
+        input.committed = false;
+    }
+
+    if (!use_uring || !run_uring(inputs)) {
+        run_threads(inputs);
+    }
+
+    return !failed;
+}
+
+void MRReader::release(MRInput *input) {
+    free(input->buffer);
+    input->buffer = NULL;
+
+    pthread_mutex_lock(&mutex);
+    in_flight--;
+    pthread_cond_signal(&not_full);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Waits until there is a free slot and takes it
+ */
+void MRReader::acquire() {
+    pthread_mutex_lock(&mutex);
+    while (in_flight >= max_in_flight) {
+        pthread_cond_wait(&not_full, &mutex);
+    }
+    in_flight++;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Pushes a filled, skipped, unread or missing input to the mapper pool
+ * The mapper disregards missing files, and opens unread files itself
+ * as it would without read-ahead
+ */
+void MRReader::dispatch(MRInput *input) {
+    if (input->unread) {
+        free(input->buffer);
+        input->buffer = NULL;
+    }
+    else if (input->buffer != NULL) {
+        input->buffer[input->size] = '\0';
+    }
+
+    // the input is never mapped, so free its slot for the others
+    if (!ThreadPool_add_work(mapper_pool, map_work, input)) {
+        pthread_mutex_lock(&mutex);
+        failed = true;
+        pthread_mutex_unlock(&mutex);
+        release(input);
+    }
+}
+
+/**
+ * Submits the statx and openat requests of an input together
+ */
+static void submit_open(Uring &ring, MRInput *input) {
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) input->file_name;
+    sqe->len = STATX_SIZE | STATX_MTIME;
+    sqe->off = (unsigned long) &input->statxbuf;
+    sqe->user_data = (unsigned long) input | OP_STATX;
+
+    sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) input->file_name;
+    sqe->open_flags = O_RDONLY;
+    sqe->user_data = (unsigned long) input | OP_OPENAT;
+
+    input->pending = 2;
+}
+
+/**
+ * Submits a read of the rest of an open and sized input
+ * Allocates the buffer on the first call
+ * Return:
+ *      true  - If a read was submitted
+ *      false - If the input is fully read or could not be read
+ */
+static bool submit_read(Uring &ring, MRInput *input) {
+    if (input->missing || input->unread) {
+        return false;
+    }
+
+    if (input->buffer == NULL) {
+        input->buffer = (char *) malloc(input->size + 1);
+        input->unread = (input->buffer == NULL);
+        if (input->unread) {
+            return false;
+        }
+    }
+
+    // continued after short reads
+    if (input->offset >= input->size) {
+        return false;
+    }
+
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = input->fd;
+    sqe->addr = (unsigned long) (input->buffer + input->offset);
+    sqe->len = std::min(input->size - input->offset, max_read);
+    sqe->off = input->offset;
+    sqe->user_data = (unsigned long) input | OP_READ;
+    input->pending = 1;
+    return true;
+}
+
+/**
+ * Submits the close of an input's file without waiting for the result
+ * Return:
+ *      The number of requests submitted
+ */
+static int submit_close(Uring &ring, MRInput *input) {
+    if (input->fd < 0) {
+        return 0;
+    }
+
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = input->fd;
+    sqe->user_data = (unsigned long) input | OP_CLOSE;
+    input->fd = -1;
+    return 1;
+}
+
+/**
+ * Submits a read of the reader's eventfd, completed by Check_work
+ */
+static void submit_wake(Uring &ring, int wake_fd, uint64_t *wake_count) {
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (unsigned long) wake_count;
+    sqe->len = sizeof(*wake_count);
+    sqe->user_data = (unsigned long) wake_count | OP_WAKE;
+}
+
+/**
+ * Reads the inputs using io_uring
+ * Each file has its statx and openat requests submitted together, its
+ * reads submitted once both complete, and its close submitted once the
+ * buffer is full. With a skip function each opened file is first checked
+ * on the check pool, which wakes the ring through an eventfd, so the
+ * submitting thread never blocks on the check.
+ * Return:
+ *      true  - If every input was handled
+ *      false - If io_uring is unavailable and nothing was read
+ */
+bool MRReader::run_uring(std::vector<MRInput> &inputs) {
+    Uring ring;
+    unsigned entries = 4;
+    while (entries < 4 * (unsigned) max_in_flight && entries < 4096) {
+        entries *= 2;
+    }
+    if (!ring.setup(entries)) {
+        return false;
+    }
+
+    // the pool skip is called on, and the eventfd it signals
+    ThreadPool_t *checkPool = NULL;
+    if (skip != NULL) {
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        checkPool = (wake_fd >= 0) ? ThreadPool_create(std::min(max_in_flight, 16)) : NULL;
+        if (checkPool == NULL) {
+            if (wake_fd >= 0) {
+                close(wake_fd);
+            }
+            return false;
+        }
+        g_pool_reader = this;
+        submit_wake(ring, wake_fd, &wake_count);
+    }
+
+    std::size_t next = 0;   // the next input to start
+    int pending = 0;        // requests submitted but not completed
+    int checking = 0;       // inputs on the check pool
+
+    while (next < inputs.size() || pending > 0 || checking > 0) {
+        // start as many inputs as there are free slots
+        pthread_mutex_lock(&mutex);
+        while (next < inputs.size() && in_flight < max_in_flight) {
+            in_flight++;
+            submit_open(ring, &inputs[next++]);
+            pending += 2;
+        }
+
+        // every slot holds a buffer waiting for a mapper
+        if (pending == 0 && checking == 0) {
+            while (next < inputs.size() && in_flight >= max_in_flight) {
+                pthread_cond_wait(&not_full, &mutex);
+            }
+            pthread_mutex_unlock(&mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&mutex);
+
+        // the inputs still in flight are abandoned
+        if (!ring.enter(1)) {
+            failed = true;
+            break;
+        }
+
+        // inputs whose check has completed, pushed by Check_work
+        std::vector<MRInput *> ready;
+
+        // handle every available completion
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            MRInput *input = (MRInput *) (cqe->user_data & ~(unsigned long) OP_MASK);
+            int op = cqe->user_data & OP_MASK;
+            int res = cqe->res;
+
+            if (op == OP_WAKE) {
+                pthread_mutex_lock(&mutex);
+                ready.insert(ready.end(), checked.begin(), checked.end());
+                checked.clear();
+                pthread_mutex_unlock(&mutex);
+                submit_wake(ring, wake_fd, &wake_count);
+                continue;
+            }
+            pending--;
+
+            switch (op) {
+            case OP_STATX:
+                // only missing files are disregarded
+                if (res == -ENOENT) {
+                    input->missing = true;
+                }
+                else if (res < 0) {
+                    input->unread = true;
+                }
+                else {
+                    input->size = input->statxbuf.stx_size;
+                    input->mtime = input->statxbuf.stx_mtime.tv_sec * 1000000000LL
+                                 + input->statxbuf.stx_mtime.tv_nsec;
+                }
+                break;
+            case OP_OPENAT:
+                // e.g. EMFILE, the mapper opens the file once a slot is free
+                if (res < 0) {
+                    input->unread = true;
+                }
+                else {
+                    input->fd = res;
+                }
+                break;
+            case OP_READ:
+                // interrupted reads are submitted again below
+                if (res == -EINTR || res == -EAGAIN) {
+                    break;
+                }
+                if (res < 0) {
+                    input->unread = true;
+                }
+                else if (res == 0) {
+                    // the file shrank since it was sized
+                    input->size = input->offset;
+                }
+                input->offset += (res > 0) ? res : 0;
+                break;
+            case OP_CLOSE:
+                continue;
+            }
+
+            if (--input->pending > 0) {
+                continue;
+            }
+
+            // check if the file can be skipped before reading it
+            bool readable = !input->missing && !input->unread;
+            if (checkPool != NULL && op != OP_READ && readable
+                    && ThreadPool_add_work(checkPool, (thread_func_t) Check_work, input)) {
+                checking++;
+                continue;
+            }
+
+            if (submit_read(ring, input)) {
+                pending++;
+                continue;
+            }
+            pending += submit_close(ring, input);
+            dispatch(input);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // skipped inputs are pushed without being read
+        for (MRInput *input : ready) {
+            checking--;
+            if (!input->skipped && submit_read(ring, input)) {
+                pending++;
+                continue;
+            }
+            pending += submit_close(ring, input);
+            dispatch(input);
+        }
+    }
+
+    if (checkPool != NULL) {
+        ThreadPool_destroy(checkPool);
+
+        // complete the outstanding eventfd read before the ring is closed
+        uint64_t one = 1;
+        bool woken = ring.failed || write(wake_fd, &one, sizeof(one)) != sizeof(one);
+        while (!woken && ring.enter(1)) {
+            unsigned head = *ring.cq_head;
+            unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                woken |= (ring.cqes[head & *ring.cq_mask].user_data & OP_MASK) == OP_WAKE;
+            }
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        close(wake_fd);
+        wake_fd = -1;
+    }
+
+    return true;
+}
+
+static void Check_work(MRInput *input) {
+    MRReader *reader = g_pool_reader;
+    input->skipped = reader->skip(input);
+
+    pthread_mutex_lock(&reader->mutex);
+    reader->checked.push_back(input);
+    pthread_mutex_unlock(&reader->mutex);
+
+    uint64_t one = 1;
+    while (write(reader->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * Reads the inputs using a pool of reader threads doing blocking reads
+ */
+void MRReader::run_threads(std::vector<MRInput> &inputs) {
+    g_pool_reader = this;
+
+    ThreadPool_t *readerPool = ThreadPool_create(std::min(max_in_flight, 16));
+    if (readerPool == NULL) {
+        failed = true;
+        return;
+    }
+
+    for (auto &input : inputs) {
+        acquire();
+        if (!ThreadPool_add_work(readerPool, (thread_func_t) Reader_work, &input)) {
+            pthread_mutex_lock(&mutex);
+            failed = true;
+            in_flight--;
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+    }
+
+    ThreadPool_destroy(readerPool);
+}
+
+static void Reader_work(MRInput *input) {
+    struct stat statbuf;
+
+    // the file is sized before it is opened so that it can be skipped
+    // only missing files are disregarded, the mapper opens the rest itself
+    if (stat(input->file_name, &statbuf) != 0) {
+        input->missing = (errno == ENOENT);
+        input->unread = !input->missing;
+        g_pool_reader->dispatch(input);
+        return;
+    }
+
+    input->size = statbuf.st_size;
+    input->mtime = statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+    if (g_pool_reader->skip != NULL && g_pool_reader->skip(input)) {
+        g_pool_reader->dispatch(input);
+        return;
+    }
+
+    MRTraceScope scope("io", "read", input->file_name);
+
+    input->fd = open(input->file_name, O_RDONLY);
+    if (input->fd < 0) {
+        input->unread = true;
+    }
+    else {
+        input->buffer = (char *) malloc(input->size + 1);
+        input->unread = (input->buffer == NULL);
+    }
+
+    if (!input->unread) {
+        read_blocking(input);
+    }
+
+    if (input->fd >= 0) {
+        close(input->fd);
+        input->fd = -1;
+    }
+
+    g_pool_reader->dispatch(input);
+}
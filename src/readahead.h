@@ -0,0 +1,102 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <cstdint>      // for uint64_t
+#include <vector>       // for std::vector
+#include <pthread.h>    // for mutexes
+#include <sys/stat.h>   // for struct statx
+
+extern "C" {
+#include "threadpool.h"
+}
+
+/**
+ * An input file and the buffer its contents are read into
+ * Owned by MR_Map, filled by the MRReader and consumed by a mapper
+ */
+struct MRInput {
+    char *file_name;        // the file to read
+    char *buffer;           // the contents of the file, NUL terminated
+                            // NULL if the file was skipped or not read ahead
+    std::size_t size;       // the number of bytes in buffer
+    long long mtime;        // the modification time in nanoseconds
+    std::size_t offset;     // the number of bytes read so far
+    int fd;                 // the open file, -1 if not open
+    int pending;            // number of outstanding io_uring operations
+    bool missing;           // the file does not exist, so it is disregarded
+    bool unread;            // the file could not be read ahead, so the
+                            // mapper opens it itself
+    bool skipped;           // did the reader's skip function return true
+    struct statx statxbuf;  // the result of the io_uring statx operation
+
+    // speculative execution bookkeeping, see MRAttempt
+    int attempts;           // number of attempts started or reserved
+    int running;            // number of attempts still running
+    bool committed;         // has an attempt committed its output
+};
+
+/**
+ * Reads input files ahead of the mapper threads
+ * Keeps at most max_in_flight files opened but not yet released, and hands
+ * each file to the mapper pool only once its buffer has been filled, so
+ * mappers never wait on storage while there is work queued.
+ * Uses io_uring when the kernel supports it, and a pool of reader
+ * threads doing blocking reads otherwise.
+ */
+struct MRReader {
+    int max_in_flight;          // max files opened but not yet mapped
+                                // at most half of RLIMIT_NOFILE
+    int in_flight;              // files opened but not yet mapped
+    pthread_mutex_t mutex;      // mutex for in_flight
+    pthread_cond_t not_full;    // signal that in_flight dropped below max
+    bool failed;                // could an input not be read or pushed
+    bool use_uring;             // may io_uring be used, true by default
+
+    // inputs checked by skip on the check pool, guarded by mutex
+    std::vector<MRInput *> checked;
+    int wake_fd;                // eventfd signalled when checked grows
+    uint64_t wake_count;        // read from wake_fd by the io_uring loop
+
+    ThreadPool_t *mapper_pool;  // the pool ready inputs are pushed to
+    thread_func_t map_work;     // the work function called with MRInput *
+
+    // called once an input is sized, inputs it returns true for are
+    // pushed without being read, NULL reads every input
+    // may block, so io_uring calls it on a pool of check threads
+    bool (*skip)(MRInput *input);
+
+    MRReader(int max_in_flight);
+    ~MRReader();
+
+    /**
+     * Reads every input and pushes it to the mapper pool once it is ready
+     * Missing inputs are pushed with missing set, and inputs that were
+     * skipped or could not be read are pushed with a NULL buffer
+     * Returns once every input has been pushed
+     * Parameters:
+     *      inputs - The inputs to read, must outlive the mapper pool
+     *      mapper_pool - The pool to push ready inputs to
+     *      map_work - The work function called with each ready MRInput
+     * Return:
+     *      true  - If every input was pushed
+     *      false - If io_uring, the reader pool or the mapper pool failed
+     *              and some inputs were never pushed
+     */
+    bool run(std::vector<MRInput> &inputs, ThreadPool_t *mapper_pool,
+             thread_func_t map_work);
+
+    /**
+     * Frees the buffer of a mapped input and releases its slot
+     * Called by the mapper once it has finished with the input
+     * Parameters:
+     *      input - The input to release
+     */
+    void release(MRInput *input);
+
+    bool run_uring(std::vector<MRInput> &inputs);
+    void run_threads(std::vector<MRInput> &inputs);
+    void acquire();
+    void dispatch(MRInput *input);
+};
+
+#endif
@@ -1,5 +1,46 @@
 #include "threadpool.h"
 
+#include <time.h>       // for clock_gettime
+
+// called when a thread waits on a ThreadPool, NULL if tracing is disabled
+// set while other pools may be running, so it is accessed atomically
+static ThreadPool_trace_func_t trace_func = NULL;
+
+/**
+ * Gets the current trace function, NULL if tracing is disabled
+ */
+static ThreadPool_trace_func_t ThreadPool_get_trace() {
+    return __atomic_load_n(&trace_func, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gets the current time of the monotonic clock in nanoseconds
+ */
+static unsigned long long ThreadPool_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Aquire the ThreadPool's mutex, tracing the wait if it is contended
+ * Parameters:
+ *      threadpool - The ThreadPool to lock
+ */
+static void ThreadPool_lock(ThreadPool_t *threadpool) {
+    ThreadPool_trace_func_t trace = ThreadPool_get_trace();
+    if (trace == NULL) {
+        pthread_mutex_lock(&threadpool->mutex);
+        return;
+    }
+
+    if (pthread_mutex_trylock(&threadpool->mutex) != 0) {
+        unsigned long long start = ThreadPool_now();
+        pthread_mutex_lock(&threadpool->mutex);
+        trace("ThreadPool mutex", start, ThreadPool_now());
+    }
+}
+
 /**
  * A C style constructor for a ThreadPool_work object
  * Parameters:
@@ -130,6 +171,135 @@ bool ThreadPool_work_queue_empty(ThreadPool_work_queue_t *work_queue) {
     return (work_queue->head == NULL);
 }
 
+/**
+* A C style constructor for creating a new ThreadPool_work_ring object
+* Parameters:
+*       capacity - The max number of tasks in the ring
+* Return:
+*       ThreadPool_work_ring_t* - The pointer to the new ThreadPool_work_ring
+*/
+ThreadPool_work_ring_t *ThreadPool_work_ring_create(int capacity) {
+    typedef ThreadPool_work_ring_t work_ring_t;
+
+    work_ring_t *work_ring = malloc(sizeof(work_ring_t));
+    if (work_ring == NULL) {
+        perror("ThreadPool_work_ring_create: malloc");
+        exit(1);
+    }
+
+    work_ring->tasks = malloc(sizeof(ThreadPool_work_t) * capacity);
+    if (work_ring->tasks == NULL) {
+        perror("ThreadPool_work_ring_create: malloc");
+        exit(1);
+    }
+
+    work_ring->capacity = capacity;
+    work_ring->head = 0;
+    work_ring->count = 0;
+
+    return work_ring;
+}
+
+/**
+* A C style destructor to destroy a ThreadPool_work_ring
+* Parameters:
+*       work_ring - The pointer to the ThreadPool_work_ring to be destroyed
+*/
+void ThreadPool_work_ring_destroy(ThreadPool_work_ring_t *work_ring) {
+    free(work_ring->tasks);
+    free(work_ring);
+}
+
+/**
+ * Push a task to the back of a ThreadPool_work_ring
+ * Parameters:
+ *      work_ring - The pointer to a ThreadPool_work_ring_t
+ *      func - The function pointer to be executed
+ *      arg - The arguments to the function pointer
+ * Returns:
+ *      true - If the task was pushed
+ *      false - If the ring is full
+ */
+bool ThreadPool_work_ring_push(ThreadPool_work_ring_t *work_ring, thread_func_t func, void *arg) {
+    if (work_ring->count == work_ring->capacity) {
+        return false;
+    }
+
+    int tail = (work_ring->head + work_ring->count) % work_ring->capacity;
+    work_ring->tasks[tail].func = func;
+    work_ring->tasks[tail].arg = arg;
+    work_ring->tasks[tail].next = NULL;
+    work_ring->count++;
+
+    return true;
+}
+
+/**
+ * Pop a task from the front of a ThreadPool_work_ring
+ * The ring must not be empty
+ * Parameters:
+ *      work_ring - The pointer to a ThreadPool_work_ring_t
+ * Return:
+ *      ThreadPool_work_t - A copy of the task, its slot may be reused
+ */
+ThreadPool_work_t ThreadPool_work_ring_pop(ThreadPool_work_ring_t *work_ring) {
+    ThreadPool_work_t work = work_ring->tasks[work_ring->head];
+
+    work_ring->head = (work_ring->head + 1) % work_ring->capacity;
+    work_ring->count--;
+
+    return work;
+}
+
+/**
+ * Check if a ThreadPool_work_ring object is empty
+ * Parameters:
+ *      work_ring - The ThreadPool_work_ring to check
+ */
+bool ThreadPool_work_ring_empty(ThreadPool_work_ring_t *work_ring) {
+    return (work_ring->count == 0);
+}
+
+/**
+ * Check if a ThreadPool_work_ring object is full
+ * Parameters:
+ *      work_ring - The ThreadPool_work_ring to check
+ */
+bool ThreadPool_work_ring_full(ThreadPool_work_ring_t *work_ring) {
+    return (work_ring->count == work_ring->capacity);
+}
+
+/**
+ * Check if a ThreadPool has no queued work
+ * The ThreadPool's mutex must be held
+ * Parameters:
+ *      threadpool - The ThreadPool to check
+ */
+static bool ThreadPool_queue_empty(ThreadPool_t *threadpool) {
+    if (threadpool->work_ring != NULL) {
+        return ThreadPool_work_ring_empty(threadpool->work_ring);
+    }
+    return ThreadPool_work_queue_empty(threadpool->work_queue);
+}
+
+/**
+ * Wake enough idle workers to run newly queued tasks
+ * The ThreadPool's mutex must be held
+ * Parameters:
+ *      threadpool - The ThreadPool to wake workers in
+ *      num - The number of tasks queued
+ */
+static void ThreadPool_wake(ThreadPool_t *threadpool, int num) {
+    if (num >= threadpool->num_idle) {
+        pthread_cond_broadcast(&threadpool->not_empty);
+        return;
+    }
+
+    for (int i = 0; i < num; i++) {
+        pthread_cond_signal(&threadpool->not_empty);
+    }
+}
+
 /**
 * Entry point for the worker threads
 * Accesses work queue and runs next task in a thread-safe manner
@@ -144,25 +314,38 @@ void *Thread_entry(void *arg) {
     
     // while the thread is running
     while (running) {
-        pthread_mutex_lock(&threadpool->mutex);
+        ThreadPool_lock(threadpool);
         // while the work queue is not empty
-        while (!ThreadPool_work_queue_empty(threadpool->work_queue)) {
+        while (!ThreadPool_queue_empty(threadpool)) {
             // get the next task from the work queue
-            ThreadPool_work_t *work = ThreadPool_work_queue_pop(threadpool->work_queue);
-            pthread_mutex_unlock(&threadpool->mutex);
+            ThreadPool_work_t work;
+            if (threadpool->work_ring != NULL) {
+                work = ThreadPool_work_ring_pop(threadpool->work_ring);
+                // awaken one producer waiting for a free slot
+                pthread_cond_signal(&threadpool->not_full);
+                pthread_mutex_unlock(&threadpool->mutex);
+            }
+            else {
+                ThreadPool_work_t *node = ThreadPool_work_queue_pop(threadpool->work_queue);
+                pthread_mutex_unlock(&threadpool->mutex);
+
+                work = *node;
+                ThreadPool_work_destroy(node);
+            }
 
             // release lock and execute work
-            work->func(work->arg);
-            ThreadPool_work_destroy(work);
+            work.func(work.arg);
 
             // reaquire lock and get next work
-            pthread_mutex_lock(&threadpool->mutex);
+            ThreadPool_lock(threadpool);
         }
 
         // if threadpool is still running    
         if (threadpool->running) {
             // wait for more work
+            threadpool->num_idle++;
             pthread_cond_wait(&threadpool->not_empty, &threadpool->mutex);
+            threadpool->num_idle--;
         }
         else {
             // stop thread
@@ -184,6 +367,19 @@ void *Thread_entry(void *arg) {
 *       ThreadPool_t* - The pointer to the newly created ThreadPool object
 */
 ThreadPool_t *ThreadPool_create(int num) {
+    return ThreadPool_create_bounded(num, 0, true);
+}
+
+/**
+* A C style constructor for creating a ThreadPool with a bounded work queue
+* Parameters:
+*       num      - The number of threads to create
+*       capacity - The max number of queued tasks, 0 for unbounded
+*       blocking - If true adding work waits while the queue is full
+* Return:
+*       ThreadPool_t* - The pointer to the newly created ThreadPool object
+*/
+ThreadPool_t *ThreadPool_create_bounded(int num, int capacity, bool blocking) {
     ThreadPool_t *threadpool = malloc(sizeof(ThreadPool_t));
     if (threadpool == NULL) {
         perror("ThreadPool_create: malloc");
@@ -191,11 +387,18 @@ ThreadPool_t *ThreadPool_create(int num) {
     }
 
     threadpool->work_queue = ThreadPool_work_queue_create();
+    threadpool->work_ring = NULL;
+    if (capacity > 0) {
+        threadpool->work_ring = ThreadPool_work_ring_create(capacity);
+    }
+    threadpool->blocking = blocking;
     pthread_mutex_init(&threadpool->mutex, NULL);
     pthread_cond_init(&threadpool->not_empty, NULL);
+    pthread_cond_init(&threadpool->not_full, NULL);
 
     threadpool->running = true;
     threadpool->num_workers = num;
+    threadpool->num_idle = 0;
     
     threadpool->workers = (pthread_t *) malloc(sizeof(pthread_t) * num);
     if (threadpool->workers == NULL) {
@@ -231,8 +434,12 @@ void ThreadPool_destroy(ThreadPool_t *threadpool) {
     }
 
     ThreadPool_work_queue_destroy(threadpool->work_queue);
+    if (threadpool->work_ring != NULL) {
+        ThreadPool_work_ring_destroy(threadpool->work_ring);
+    }
     pthread_mutex_destroy(&threadpool->mutex);
     pthread_cond_destroy(&threadpool->not_empty);
+    pthread_cond_destroy(&threadpool->not_full);
 
     free(threadpool->workers);
     free(threadpool);
@@ -249,16 +456,87 @@ void ThreadPool_destroy(ThreadPool_t *threadpool) {
 *       false - Otherwise
 */
 bool ThreadPool_add_work(ThreadPool_t *threadpool, thread_func_t func, void *arg) {
-    ThreadPool_work_t *work = ThreadPool_work_create(func, arg);
-    if (work == NULL) {
-        return false;
+    return ThreadPool_add_work_batch(threadpool, func, &arg, 1) == 1;
+}
+
+/**
+* Add many tasks with the same function to the ThreadPool's task queue
+* Parameters:
+*       tp   - The ThreadPool object to add the tasks to
+*       func - The function pointer that will be called for each task
+*       args - The array of arguments, one per task
+*       num  - The number of tasks
+* Return:
+*       int - The number of tasks added
+*/
+int ThreadPool_add_work_batch(ThreadPool_t *threadpool, thread_func_t func, void **args, int num) {
+    int added = 0;
+
+    if (threadpool->work_ring == NULL) {
+        // allocate the nodes before aquiring the lock
+        ThreadPool_work_t *head = NULL, *tail = NULL;
+        for (; added < num; added++) {
+            ThreadPool_work_t *work = ThreadPool_work_create(func, args[added]);
+            if (work == NULL) {
+                break;
+            }
+            if (tail == NULL) {
+                head = work;
+            }
+            else {
+                tail->next = work;
+            }
+            tail = work;
+        }
+
+        if (added == 0) {
+            return 0;
+        }
+
+        ThreadPool_lock(threadpool);
+        ThreadPool_work_queue_push(threadpool->work_queue, head);
+        threadpool->work_queue->tail = tail;
+        // awaken as many idle threads as there are new tasks
+        ThreadPool_wake(threadpool, added);
+        pthread_mutex_unlock(&threadpool->mutex);
+
+        return added;
     }
 
-    pthread_mutex_lock(&threadpool->mutex);
-    ThreadPool_work_queue_push(threadpool->work_queue, work);
-    // awaken one idle thread (if any are idle)
-    pthread_cond_signal(&threadpool->not_empty);
+    ThreadPool_lock(threadpool);
+    while (added < num) {
+        // wait until a slot is free, or give up if not blocking
+        if (ThreadPool_work_ring_full(threadpool->work_ring)) {
+            if (!threadpool->blocking) {
+                break;
+            }
+            ThreadPool_trace_func_t trace = ThreadPool_get_trace();
+            unsigned long long start = (trace != NULL) ? ThreadPool_now() : 0;
+            pthread_cond_wait(&threadpool->not_full, &threadpool->mutex);
+            if (trace != NULL) {
+                trace("ThreadPool full", start, ThreadPool_now());
+            }
+            continue;
+        }
+
+        // fill every free slot before waking the workers
+        int pushed = 0;
+        while (added < num && ThreadPool_work_ring_push(threadpool->work_ring, func, args[added])) {
+            added++;
+            pushed++;
+        }
+        ThreadPool_wake(threadpool, pushed);
+    }
     pthread_mutex_unlock(&threadpool->mutex);
 
-    return true;
+    return added;
+}
+
+/**
+* Set a function to be called whenever a thread waits on a ThreadPool
+* Parameters:
+*       trace - The function to call, or NULL to disable tracing
+*/
+void ThreadPool_set_trace(ThreadPool_trace_func_t trace) {
+    __atomic_store_n(&trace_func, trace, __ATOMIC_RELAXED);
 }
\ No newline at end of file
@@ -7,6 +7,9 @@
 #include <stdlib.h>     // for malloc, free
 
 typedef void (*thread_func_t)(void *arg);
+typedef void (*ThreadPool_trace_func_t)(const char *name,
+                                        unsigned long long start_ns,
+                                        unsigned long long end_ns);
 
 /**
  * ThreadPool_work_t stores a function pointer and arguments
@@ -28,14 +31,29 @@ typedef struct {
     ThreadPool_work_t *tail;    // the tail of the linked list
 } ThreadPool_work_queue_t;
 
+/**
+ * ThreadPool_work_ring_t is a fixed capacity circular buffer
+ * Tasks are stored by value, so pushing and popping never allocate
+ */
+typedef struct {
+    ThreadPool_work_t *tasks;   // the array of capacity tasks
+    int capacity;               // the max number of tasks
+    int head;                   // the index of the first task
+    int count;                  // the number of tasks in the ring
+} ThreadPool_work_ring_t;
+
 typedef struct {
     int running;                // is the threadpool running
     int num_workers;            // number of workers in threadpool
+    int num_idle;               // number of workers waiting for work
     pthread_t *workers;         // pointer to array of thread IDs
     
-    ThreadPool_work_queue_t *work_queue;    // the work queue
+    ThreadPool_work_queue_t *work_queue;    // the unbounded work queue
+    ThreadPool_work_ring_t *work_ring;      // the bounded work queue, or NULL
+    bool blocking;              // does adding work wait while the ring is full
     pthread_mutex_t mutex;      // mutex for the work queue
     pthread_cond_t not_empty;   // signal that the work queue is not empty
+    pthread_cond_t not_full;    // signal that the work ring is not full
 } ThreadPool_t;
 
 
@@ -48,6 +66,19 @@ typedef struct {
 */
 ThreadPool_t *ThreadPool_create(int num);
 
+/**
+* A C style constructor for creating a ThreadPool with a bounded work queue
+* Memory use stays constant regardless of how much work is added
+* Parameters:
+*       num      - The number of threads to create
+*       capacity - The max number of queued tasks
+*       blocking - If true adding work waits while the queue is full,
+*                  otherwise it fails immediately
+* Return:
+*       ThreadPool_t* - The pointer to the newly created ThreadPool object
+*/
+ThreadPool_t *ThreadPool_create_bounded(int num, int capacity, bool blocking);
+
 /**
 * A C style destructor to destroy a ThreadPool object
 * Parameters:
@@ -67,4 +98,28 @@ void ThreadPool_destroy(ThreadPool_t *tp);
 */
 bool ThreadPool_add_work(ThreadPool_t *tp, thread_func_t func, void *arg);
 
+/**
+* Add many tasks with the same function to the ThreadPool's task queue
+* The tasks are added under a single lock acquisition (per batch of free
+* slots in a bounded queue) and only as many workers as needed are woken
+* Parameters:
+*       tp   - The ThreadPool object to add the tasks to
+*       func - The function pointer that will be called for each task
+*       args - The array of arguments, one per task
+*       num  - The number of tasks
+* Return:
+*       int - The number of tasks added, less than num if the bounded
+*             queue is full and not blocking or memory ran out
+*/
+int ThreadPool_add_work_batch(ThreadPool_t *tp, thread_func_t func, void **args, int num);
+
+/**
+* Set a function to be called whenever a thread waits on a ThreadPool
+* Called for contended acquisitions of the mutex and for producers waiting
+* on a full bounded queue, with CLOCK_MONOTONIC start and end times
+* Parameters:
+*       trace - The function to call, or NULL to disable tracing
+*/
+void ThreadPool_set_trace(ThreadPool_trace_func_t trace);
+
 #endif
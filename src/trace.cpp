@@ -0,0 +1,166 @@
+#include <algorithm>    // for std::min
+#include <cstdio>       // for FILE, fprintf
+#include <ctime>        // for clock_gettime
+#include <vector>       // for std::vector
+#include <unistd.h>     // for getpid
+
+#include "trace.h"
+
+// the number of events kept per thread, must be a power of two
+static const unsigned long trace_capacity = 16 * 1024;
+
+/**
+ * The ring buffer of events recorded by a single thread
+ * Only the owning thread writes to it, so no lock is required
+ */
+struct MRTraceBuffer {
+    MRTraceEvent events[trace_capacity];
+    unsigned long count;        // the number of events ever recorded
+    int tid;                    // the thread number shown in the trace
+};
+
+bool g_tracing;
+
+// every buffer created since MR_TraceBegin
+static std::vector<MRTraceBuffer *> g_buffers;
+static pthread_mutex_t g_buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// incremented by MR_TraceBegin, so threads know their buffer is stale
+static unsigned long g_generation;
+
+// the calling thread's buffer, valid if t_generation == g_generation
+static thread_local MRTraceBuffer *t_buffer;
+static thread_local unsigned long t_generation;
+
+unsigned long long MR_TraceNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Frees every buffer, so threads register a new one when tracing resumes
+ */
+static void free_buffers() {
+    pthread_mutex_lock(&g_buffers_mutex);
+    for (MRTraceBuffer *buffer : g_buffers) {
+        delete buffer;
+    }
+    g_buffers.clear();
+    g_generation++;
+    pthread_mutex_unlock(&g_buffers_mutex);
+}
+
+void MR_TraceBegin() {
+    free_buffers();
+    __atomic_store_n(&g_tracing, true, __ATOMIC_RELAXED);
+}
+
+void MR_TraceRecord(const char *category, const char *name, const char *file,
+                    int partition, unsigned long long start, unsigned long long end) {
+    // register a new buffer the first time this thread records an event
+    if (t_generation != g_generation) {
+        pthread_mutex_lock(&g_buffers_mutex);
+        t_buffer = new MRTraceBuffer;
+        t_buffer->count = 0;
+        t_buffer->tid = g_buffers.size();
+        t_generation = g_generation;
+        g_buffers.push_back(t_buffer);
+        pthread_mutex_unlock(&g_buffers_mutex);
+    }
+
+    MRTraceEvent &event = t_buffer->events[t_buffer->count % trace_capacity];
+    event.category = category;
+    event.name = name;
+    event.file = file;
+    event.partition = partition;
+    event.start = start;
+    event.end = end;
+    t_buffer->count++;
+}
+
+void MR_TraceWait(const char *name, unsigned long long start, unsigned long long end) {
+    MR_TraceRecord("lock", name, NULL, -1, start, end);
+}
+
+/**
+ * Writes a string as a JSON string literal
+ */
+static void write_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        }
+        else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        }
+        else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+void MR_TraceEnd(const char *path) {
+    __atomic_store_n(&g_tracing, false, __ATOMIC_RELAXED);
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("MR_TraceEnd: fopen");
+        free_buffers();
+        return;
+    }
+
+    // timestamps are relative to the earliest event
+    unsigned long long origin = ~0ULL;
+    for (MRTraceBuffer *buffer : g_buffers) {
+        unsigned long first = buffer->count > trace_capacity ? buffer->count - trace_capacity : 0;
+        for (unsigned long i = first; i < buffer->count; i++) {
+            origin = std::min(origin, buffer->events[i % trace_capacity].start);
+        }
+    }
+
+    int pid = getpid();
+    bool first_event = true;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", fp);
+
+    for (MRTraceBuffer *buffer : g_buffers) {
+        unsigned long first = buffer->count > trace_capacity ? buffer->count - trace_capacity : 0;
+        for (unsigned long i = first; i < buffer->count; i++) {
+            MRTraceEvent &event = buffer->events[i % trace_capacity];
+
+            fputs(first_event ? "\n" : ",\n", fp);
+            first_event = false;
+
+            // complete events with microsecond timestamps
+            fputs("{\"name\":", fp);
+            write_json_string(fp, event.name);
+            fputs(",\"cat\":", fp);
+            write_json_string(fp, event.category);
+            fprintf(fp, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{",
+                    (event.start - origin) / 1000.0, (event.end - event.start) / 1000.0,
+                    pid, buffer->tid);
+            if (event.file != NULL) {
+                fputs("\"file\":", fp);
+                write_json_string(fp, event.file);
+            }
+            if (event.partition >= 0) {
+                fprintf(fp, "%s\"partition\":%d", event.file != NULL ? "," : "", event.partition);
+            }
+            fputs("}}", fp);
+        }
+
+        // report events lost to the ring buffer wrapping around
+        if (buffer->count > trace_capacity) {
+            fprintf(stderr, "MR_TraceEnd: thread %d dropped %lu events\n",
+                    buffer->tid, buffer->count - trace_capacity);
+        }
+    }
+
+    fputs("\n]}\n", fp);
+    fclose(fp);
+
+    free_buffers();
+}
@@ -0,0 +1,106 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>    // for mutexes
+
+/**
+ * A timestamped span recorded by a single thread
+ */
+struct MRTraceEvent {
+    const char *category;       // the kind of event, e.g. "task" or "lock"
+    const char *name;           // the name of the event
+    const char *file;           // the input file, or NULL
+    int partition;              // the partition number, or -1
+    unsigned long long start;   // the start time in nanoseconds
+    unsigned long long end;     // the end time in nanoseconds
+};
+
+// is tracing enabled, checked before recording any event
+// only access it through MR_Tracing, since it is read by every thread
+extern bool g_tracing;
+
+/**
+ * Checks if tracing is enabled
+ */
+inline bool MR_Tracing() {
+    return __atomic_load_n(&g_tracing, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gets the current time of the monotonic clock in nanoseconds
+ */
+unsigned long long MR_TraceNow();
+
+/**
+ * Clears the events of the previous run and enables tracing
+ */
+void MR_TraceBegin();
+
+/**
+ * Disables tracing, writes every recorded event as Chrome trace JSON
+ * and frees the buffers the events were recorded in
+ * Must only be called once the threads that recorded events are idle
+ * Parameters:
+ *      path - The file to write the trace to
+ */
+void MR_TraceEnd(const char *path);
+
+/**
+ * Records an event in the calling thread's buffer
+ * Each thread writes to its own fixed size ring buffer, so recording
+ * never takes a lock, and the oldest events are overwritten when full
+ */
+void MR_TraceRecord(const char *category, const char *name, const char *file,
+                    int partition, unsigned long long start, unsigned long long end);
+
+/**
+ * Records the time a ThreadPool spent waiting, used as the ThreadPool hook
+ */
+void MR_TraceWait(const char *name, unsigned long long start, unsigned long long end);
+
+/**
+ * Locks a mutex, recording the wait if it was contended
+ * Parameters:
+ *      mutex - The mutex to lock
+ *      name - The name of the mutex in the trace
+ *      partition - The partition the mutex belongs to, or -1
+ */
+inline void MR_TraceLock(pthread_mutex_t *mutex, const char *name, int partition) {
+    if (!MR_Tracing()) {
+        pthread_mutex_lock(mutex);
+        return;
+    }
+
+    // only contended acquisitions are recorded
+    if (pthread_mutex_trylock(mutex) != 0) {
+        unsigned long long start = MR_TraceNow();
+        pthread_mutex_lock(mutex);
+        MR_TraceRecord("lock", name, NULL, partition, start, MR_TraceNow());
+    }
+}
+
+/**
+ * Records a span covering the lifetime of the object
+ */
+struct MRTraceScope {
+    const char *category, *name, *file;
+    int partition;
+    unsigned long long start;
+
+    MRTraceScope(const char *category, const char *name,
+                 const char *file = NULL, int partition = -1) {
+        this->category = category;
+        this->name = name;
+        this->file = file;
+        this->partition = partition;
+        start = MR_Tracing() ? MR_TraceNow() : 0;
+    }
+
+    ~MRTraceScope() {
+        if (MR_Tracing() && start != 0) {
+            MR_TraceRecord(category, name, file, partition, start, MR_TraceNow());
+        }
+    }
+};
+
+#endif
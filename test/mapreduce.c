@@ -0,0 +1,658 @@
+// the tests rely on assert, which Release builds disable
+#undef NDEBUG
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../src/mapreduce.h"
+
+#define MAX_FILES 64
+#define MAX_PARTITIONS 16
+#define MAX_KEYS 1024
+
+char dir[] = "/tmp/mapreduce-test-XXXXXX";
+char *files[MAX_FILES];
+int num_files;
+
+// the number of times each key was written to the input files
+long expected_count[MAX_KEYS];
+
+// the first and last key reduced by each partition, and the number of values
+char *first_key[MAX_PARTITIONS];
+char *last_key[MAX_PARTITIONS];
+long values_reduced[MAX_PARTITIONS];
+
+// the count of each key reduced by MR_Run and aggregated by MR_RunAggregate
+long reduced_count[MAX_KEYS];
+long aggregated_count[MAX_KEYS];
+
+// the number of times the mapper was called for each file
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+int map_calls[MAX_FILES];
+int maps_finished[MAX_FILES];
+int slow_file = -1;
+int slow_cancelled;
+
+// the number of files mapped without a read-ahead buffer
+int unread_calls;
+
+/**
+ * Writes count files of num_keys random keys each, one key per line
+ * Keys are numbers less than key_range, which are counted in
+ * expected_count if key_range is at most MAX_KEYS
+ */
+void make_input(int count, int num_keys, int key_range) {
+    num_files = count;
+    memset(expected_count, 0, sizeof(expected_count));
+    for (int i = 0; i < num_files; i++) {
+        files[i] = malloc(strlen(dir) + 16);
+        sprintf(files[i], "%s/in-%d.txt", dir, i);
+        FILE *fp = fopen(files[i], "w");
+        assert(fp != NULL);
+        for (int j = 0; j < num_keys; j++) {
+            int key = rand() % key_range;
+            fprintf(fp, "%d\n", key);
+            if (key_range <= MAX_KEYS) {
+                expected_count[key]++;
+            }
+        }
+        fclose(fp);
+    }
+}
+
+void remove_input() {
+    for (int i = 0; i < num_files; i++) {
+        unlink(files[i]);
+        free(files[i]);
+    }
+    num_files = 0;
+}
+
+/**
+ * Gets the index of an input file from its name
+ */
+int file_index(char *file_name) {
+    int index;
+    int matched = sscanf(strrchr(file_name, '/'), "/in-%d.txt", &index);
+    assert(matched == 1 && index >= 0 && index < MAX_FILES);
+    return index;
+}
+
+/**
+ * Emits every line of a file as a key
+ */
+void emit_file(char *file_name) {
+    FILE *fp = fopen(file_name, "r");
+    assert(fp != NULL);
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, fp)) != -1) {
+        line[len - 1] = '\0';
+        MR_Emit(line, "1");
+    }
+    free(line);
+    fclose(fp);
+}
+
+void mock_map(char *file_name) {
+    int index = file_index(file_name);
+    pthread_mutex_lock(&mutex);
+    int call = ++map_calls[index];
+    pthread_mutex_unlock(&mutex);
+
+    emit_file(file_name);
+
+    // the first attempt at the slow file stalls until its backup commits
+    if (index == slow_file && call == 1) {
+        for (int i = 0; i < 10000 && !MR_Cancelled(); i++) {
+            usleep(1000);
+        }
+        slow_cancelled = MR_Cancelled();
+    }
+
+    pthread_mutex_lock(&mutex);
+    maps_finished[index]++;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Maps a file through MR_GetInput, only opening it if it was not read ahead
+ */
+void input_map(char *file_name) {
+    int index = file_index(file_name);
+    pthread_mutex_lock(&mutex);
+    map_calls[index]++;
+    pthread_mutex_unlock(&mutex);
+
+    size_t size;
+    char *buffer = MR_GetInput(&size);
+    if (buffer == NULL) {
+        pthread_mutex_lock(&mutex);
+        unread_calls++;
+        pthread_mutex_unlock(&mutex);
+        emit_file(file_name);
+        return;
+    }
+
+    // the buffer holds the whole file and is NUL terminated
+    struct stat statbuf;
+    int ret = stat(file_name, &statbuf);
+    assert(ret == 0 && (size_t) statbuf.st_size == size);
+    assert(buffer[size] == '\0' && strlen(buffer) == size);
+
+    char key[32];
+    for (char *line = buffer; *line != '\0';) {
+        char *end = strchr(line, '\n');
+        assert(end != NULL && (size_t) (end - line) < sizeof(key));
+        memcpy(key, line, end - line);
+        key[end - line] = '\0';
+        MR_Emit(key, "1");
+        line = end + 1;
+    }
+}
+
+void mock_reduce(char *key, int partition_number) {
+    // keys within a partition are reduced in ascending order
+    assert(last_key[partition_number] == NULL || strcmp(last_key[partition_number], key) < 0);
+    if (first_key[partition_number] == NULL) {
+        first_key[partition_number] = strdup(key);
+    }
+    free(last_key[partition_number]);
+    last_key[partition_number] = strdup(key);
+
+    long count = 0;
+    while (MR_GetNext(key, partition_number) != NULL) {
+        count++;
+    }
+    values_reduced[partition_number] += count;
+
+    int index = atoi(key);
+    if (index < MAX_KEYS) {
+        reduced_count[index] = count;
+    }
+}
+
+void *mock_update(char *key, void *state, char *value) {
+    long *count = state;
+    if (count == NULL) {
+        count = calloc(1, sizeof(long));
+    }
+    (*count)++;
+    return count;
+}
+
+void mock_aggregate(char *key, void *state, int partition_number) {
+    aggregated_count[atoi(key)] = *(long *) state;
+    free(state);
+}
+
+void clear_results() {
+    for (int i = 0; i < MAX_PARTITIONS; i++) {
+        free(first_key[i]);
+        free(last_key[i]);
+        first_key[i] = last_key[i] = NULL;
+        values_reduced[i] = 0;
+    }
+    memset(reduced_count, 0, sizeof(reduced_count));
+    memset(aggregated_count, 0, sizeof(aggregated_count));
+    memset(map_calls, 0, sizeof(map_calls));
+    memset(maps_finished, 0, sizeof(maps_finished));
+    unread_calls = 0;
+}
+
+void test_range_partition(int count, int num_keys, int num_partitions) {
+    make_input(count, num_keys, RAND_MAX);
+    MR_SetPartitioner(MR_RangePartition);
+    MR_Run(num_files, files, mock_map, 4, mock_reduce, num_partitions);
+    MR_SetPartitioner(NULL);
+
+    // every key in partition i is less than every key in partition i + 1
+    long total = 0;
+    char *previous = NULL;
+    int non_empty = 0;
+    for (int i = 0; i < num_partitions; i++) {
+        total += values_reduced[i];
+        if (first_key[i] == NULL) {
+            continue;
+        }
+        assert(previous == NULL || strcmp(previous, first_key[i]) < 0);
+        previous = last_key[i];
+        non_empty++;
+    }
+    assert(total == (long) count * num_keys);
+
+    // the split points spread the keys over every partition
+    assert(num_keys == 0 || non_empty == num_partitions);
+
+    clear_results();
+    remove_input();
+}
+
+void test_aggregate(int count, int num_keys, int read_ahead) {
+    make_input(count, num_keys, MAX_KEYS);
+    MR_SetReadAhead(read_ahead);
+    MR_Run(num_files, files, mock_map, 4, mock_reduce, 8);
+    MR_RunAggregate(num_files, files, mock_map, 4, mock_update, mock_aggregate, 8);
+    MR_SetReadAhead(0);
+
+    // both modes count every occurrence of every key
+    for (int i = 0; i < MAX_KEYS; i++) {
+        assert(reduced_count[i] == expected_count[i]);
+        assert(aggregated_count[i] == expected_count[i]);
+    }
+
+    clear_results();
+    remove_input();
+}
+
+void test_speculation(int count, int num_keys, int aggregate) {
+    make_input(count, num_keys, MAX_KEYS);
+    slow_file = 0;
+    slow_cancelled = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    MR_SetSpeculation(1);
+    if (aggregate) {
+        MR_RunAggregate(num_files, files, mock_map, 4, mock_update, mock_aggregate, 8);
+    }
+    else {
+        MR_Run(num_files, files, mock_map, 4, mock_reduce, 8);
+    }
+    MR_SetSpeculation(0);
+    slow_file = -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // the run does not wait out the 10 second stall
+    assert(end.tv_sec - start.tv_sec < 5);
+
+    // the slow file was backed up, and the losing attempt was cut short
+    assert(map_calls[0] == 2 && maps_finished[0] == 2);
+    assert(slow_cancelled == 1);
+    for (int i = 1; i < count; i++) {
+        assert(map_calls[i] >= 1 && maps_finished[i] == map_calls[i]);
+    }
+
+    // every file was committed exactly once
+    long *counts = aggregate ? aggregated_count : reduced_count;
+    for (int i = 0; i < MAX_KEYS; i++) {
+        assert(counts[i] == expected_count[i]);
+    }
+
+    clear_results();
+    remove_input();
+}
+
+void test_read_ahead(int count, int num_keys, int max_in_flight, int uring) {
+    make_input(count, num_keys, MAX_KEYS);
+
+    // an empty file is read, a missing file is disregarded
+    files[num_files] = malloc(strlen(dir) + 16);
+    sprintf(files[num_files], "%s/in-%d.txt", dir, num_files);
+    FILE *fp = fopen(files[num_files], "w");
+    assert(fp != NULL);
+    fclose(fp);
+    num_files++;
+
+    char missing[64];
+    sprintf(missing, "%s/in-%d.txt", dir, MAX_FILES - 1);
+    char *names[MAX_FILES];
+    memcpy(names, files, num_files * sizeof(char *));
+    names[num_files] = missing;
+
+    MR_SetReadAhead(max_in_flight);
+    MR_SetUring(uring);
+    MR_Run(num_files + 1, names, input_map, 4, mock_reduce, 8);
+    MR_SetUring(1);
+    MR_SetReadAhead(0);
+
+    // every existing file was read ahead and mapped once
+    assert(unread_calls == 0);
+    for (int i = 0; i < num_files; i++) {
+        assert(map_calls[i] == 1);
+    }
+    assert(map_calls[MAX_FILES - 1] == 0);
+
+    for (int i = 0; i < MAX_KEYS; i++) {
+        assert(reduced_count[i] == expected_count[i]);
+    }
+
+    clear_results();
+    remove_input();
+}
+
+/**
+ * Runs MR_Run over the input with input_map, checking every key's count
+ */
+void run_input_map() {
+    MR_Run(num_files, files, input_map, 4, mock_reduce, 8);
+    for (int i = 0; i < MAX_KEYS; i++) {
+        assert(reduced_count[i] == expected_count[i]);
+    }
+}
+
+/**
+ * Truncates every cache entry in a directory by one byte, so that its
+ * header still matches but its pairs cannot be loaded
+ * Return: The number of entries truncated
+ */
+int truncate_entries(char *cache) {
+    int truncated = 0;
+    DIR *dp = opendir(cache);
+    assert(dp != NULL);
+    struct dirent *entry;
+    char path[128];
+    struct stat statbuf;
+    while ((entry = readdir(dp)) != NULL) {
+        if (strstr(entry->d_name, ".mrc") == NULL) {
+            continue;
+        }
+        sprintf(path, "%s/%s", cache, entry->d_name);
+        int ret = stat(path, &statbuf);
+        assert(ret == 0 && statbuf.st_size > 0);
+        ret = truncate(path, statbuf.st_size - 1);
+        assert(ret == 0);
+        truncated++;
+    }
+    closedir(dp);
+    return truncated;
+}
+
+void remove_entries(char *cache) {
+    DIR *dp = opendir(cache);
+    assert(dp != NULL);
+    struct dirent *entry;
+    char path[128];
+    while ((entry = readdir(dp)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            sprintf(path, "%s/%s", cache, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dp);
+    rmdir(cache);
+}
+
+void test_cache(int count, int num_keys, int read_ahead) {
+    make_input(count, num_keys, MAX_KEYS);
+    char cache[64];
+    sprintf(cache, "%s/cache", dir);
+    int ret = mkdir(cache, 0700);
+    assert(ret == 0);
+    MR_SetReadAhead(read_ahead);
+    MR_SetCache(cache, "count");
+
+    // the first run maps every file, reading it ahead if enabled
+    run_input_map();
+    for (int i = 0; i < num_files; i++) {
+        assert(map_calls[i] == 1);
+    }
+    assert(unread_calls == (read_ahead ? 0 : num_files));
+    clear_results();
+
+    // the second run replays every file from the cache
+    run_input_map();
+    for (int i = 0; i < num_files; i++) {
+        assert(map_calls[i] == 0);
+    }
+    clear_results();
+
+    // a file whose modification time or size changed is mapped again
+    struct timespec times[2] = {{1, 0}, {1, 0}};
+    ret = utimensat(AT_FDCWD, files[0], times, 0);
+    assert(ret == 0);
+    FILE *fp = fopen(files[1], "a");
+    assert(fp != NULL);
+    fputs("0\n", fp);
+    fclose(fp);
+    expected_count[0]++;
+    run_input_map();
+    for (int i = 0; i < num_files; i++) {
+        assert(map_calls[i] == (i < 2));
+    }
+    clear_results();
+
+    // a different mapper does not use the entries of another
+    MR_SetCache(cache, "other");
+    run_input_map();
+    for (int i = 0; i < num_files; i++) {
+        assert(map_calls[i] == 1);
+    }
+    clear_results();
+
+    // entries whose header matches but whose pairs are cut short are
+    // skipped by read-ahead, then fail to load, so are mapped unread
+    int truncated = truncate_entries(cache);
+    assert(truncated == 2 * num_files);
+    run_input_map();
+    for (int i = 0; i < num_files; i++) {
+        assert(map_calls[i] == 1);
+    }
+    assert(unread_calls == num_files);
+    clear_results();
+
+    MR_SetCache(NULL, NULL);
+    MR_SetReadAhead(0);
+    remove_entries(cache);
+    remove_input();
+}
+
+/**
+ * Reads a whole file into a NUL terminated buffer
+ * Return: The buffer, NULL if the file could not be opened
+ */
+char *read_file(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char *buffer = malloc(size + 1);
+    size_t read = fread(buffer, 1, size, fp);
+    assert(read == (size_t) size);
+    buffer[size] = '\0';
+    fclose(fp);
+    return buffer;
+}
+
+void skip_space(const char **p) {
+    while (isspace((unsigned char) **p)) {
+        (*p)++;
+    }
+}
+
+/**
+ * Parses a single JSON value, advancing past it
+ * Return: 1 if the text starting at *p is a valid value, 0 otherwise
+ */
+int parse_json(const char **p) {
+    skip_space(p);
+    if (**p == '{' || **p == '[') {
+        char close = (**p == '{') ? '}' : ']';
+        (*p)++;
+        skip_space(p);
+        if (**p == close) {
+            (*p)++;
+            return 1;
+        }
+        while (1) {
+            // an object member is a string key and a colon before its value
+            if (close == '}') {
+                skip_space(p);
+                if (**p != '"' || !parse_json(p)) {
+                    return 0;
+                }
+                skip_space(p);
+                if (*(*p)++ != ':') {
+                    return 0;
+                }
+            }
+            if (!parse_json(p)) {
+                return 0;
+            }
+            skip_space(p);
+            if (**p != ',') {
+                break;
+            }
+            (*p)++;
+        }
+        return *(*p)++ == close;
+    }
+
+    if (**p == '"') {
+        for ((*p)++; **p != '"'; (*p)++) {
+            if ((unsigned char) **p < 0x20) {
+                return 0;
+            }
+            if (**p == '\\') {
+                (*p)++;
+                if (**p == 'u') {
+                    for (int i = 0; i < 4; i++) {
+                        if (!isxdigit((unsigned char) *++(*p))) {
+                            return 0;
+                        }
+                    }
+                }
+                else if (**p == '\0' || strchr("\"\\/bfnrt", **p) == NULL) {
+                    return 0;
+                }
+            }
+        }
+        (*p)++;
+        return 1;
+    }
+
+    if (**p == '-' || isdigit((unsigned char) **p)) {
+        char *end;
+        strtod(*p, &end);
+        *p = end;
+        return 1;
+    }
+
+    const char *literals[] = {"true", "false", "null"};
+    for (int i = 0; i < 3; i++) {
+        if (strncmp(*p, literals[i], strlen(literals[i])) == 0) {
+            *p += strlen(literals[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Counts the events with a name and category, checking that each one
+ * has an argument
+ */
+int count_events(char *trace, char *name, char *cat, char *arg) {
+    char event[64];
+    sprintf(event, "{\"name\":\"%s\",\"cat\":\"%s\",", name, cat);
+    int count = 0;
+    for (char *s = strstr(trace, event); s != NULL; s = strstr(s + 1, event)) {
+        char *args = strstr(s, "\"args\":{");
+        char *end = strchr(s, '}');
+        assert(args != NULL && end != NULL && args < end);
+        if (arg != NULL) {
+            char *found = strstr(args, arg);
+            assert(found != NULL && found < strchr(args, '}'));
+        }
+        count++;
+    }
+    return count;
+}
+
+void test_trace(int count, int num_keys, int num_partitions) {
+    make_input(count, num_keys, MAX_KEYS);
+    char path[64];
+    sprintf(path, "%s/trace.json", dir);
+
+    MR_SetTrace(path);
+    MR_Run(num_files, files, mock_map, 4, mock_reduce, num_partitions);
+    MR_SetTrace(NULL);
+
+    // the trace is a single valid JSON object
+    char *trace = read_file(path);
+    assert(trace != NULL);
+    const char *p = trace;
+    int valid = parse_json(&p);
+    skip_space(&p);
+    assert(valid && *p == '\0' && trace[0] == '{');
+    assert(strstr(trace, "\"traceEvents\":[") != NULL);
+
+    // both phases, a map task per file and a reduce task per partition
+    assert(count_events(trace, "map", "phase", NULL) == 1);
+    assert(count_events(trace, "reduce", "phase", NULL) == 1);
+    assert(count_events(trace, "map", "task", "\"file\":\"") == count);
+    assert(count_events(trace, "reduce", "task", "\"partition\":") == num_partitions);
+    for (int i = 0; i < count; i++) {
+        char file[128];
+        sprintf(file, "\"file\":\"%s\"", files[i]);
+        assert(strstr(trace, file) != NULL);
+    }
+    for (int i = 0; i < num_partitions; i++) {
+        char partition[32];
+        sprintf(partition, "\"partition\":%d}", i);
+        assert(strstr(trace, partition) != NULL);
+    }
+    free(trace);
+    clear_results();
+
+    // no trace is written once tracing is disabled
+    unlink(path);
+    MR_Run(num_files, files, mock_map, 4, mock_reduce, num_partitions);
+    assert(access(path, F_OK) != 0);
+
+    clear_results();
+    remove_input();
+}
+
+int main(int argc, char *argv[]) {
+    fputs("Testing MapReduce: ", stdout);
+    char *created = mkdtemp(dir);
+    assert(created != NULL);
+    srand(1);
+
+    // fewer pairs than are staged before the splits are chosen
+    test_range_partition(1, 0, 4);
+    test_range_partition(1, 1000, 4);
+    test_range_partition(4, 1000, 8);
+    // more pairs, so the splits are chosen during the map phase
+    test_range_partition(16, 20000, 8);
+
+    test_aggregate(1, 0, 0);
+    test_aggregate(16, 10000, 0);
+    test_aggregate(16, 10000, 4);
+
+    // with io_uring when supported, then with the reader threads
+    test_read_ahead(16, 10000, 4, 1);
+    test_read_ahead(16, 10000, 1, 1);
+    test_read_ahead(16, 10000, 4, 0);
+    test_read_ahead(16, 10000, 1, 0);
+
+    test_cache(8, 5000, 0);
+    test_cache(8, 5000, 4);
+
+    test_trace(8, 1000, 4);
+
+    test_speculation(8, 5000, 0);
+    test_speculation(8, 5000, 1);
+
+    rmdir(dir);
+    fputs("Passed \n", stdout);
+    return 0;
+}
@@ -1,3 +1,6 @@
+// the tests rely on assert, which Release builds disable
+#undef NDEBUG
+
 #include <stdio.h>
 #include <assert.h>
 
@@ -14,6 +17,14 @@ void ThreadPool_work_queue_push(ThreadPool_work_queue_t *work_queue, ThreadPool_
 ThreadPool_work_t *ThreadPool_work_queue_pop(ThreadPool_work_queue_t *work_queue);
 bool ThreadPool_work_queue_empty(ThreadPool_work_queue_t *work_queue);
 
+// ThreadPool_work_ring function prototypes
+ThreadPool_work_ring_t *ThreadPool_work_ring_create(int capacity);
+void ThreadPool_work_ring_destroy(ThreadPool_work_ring_t *work_ring);
+bool ThreadPool_work_ring_push(ThreadPool_work_ring_t *work_ring, thread_func_t func, void *arg);
+ThreadPool_work_t ThreadPool_work_ring_pop(ThreadPool_work_ring_t *work_ring);
+bool ThreadPool_work_ring_empty(ThreadPool_work_ring_t *work_ring);
+bool ThreadPool_work_ring_full(ThreadPool_work_ring_t *work_ring);
+
 // testing data
 const char *message[5] = {
     "ThreadPool_work 1",
@@ -60,11 +71,65 @@ void test_delete_full() {
     ThreadPool_work_queue_destroy(work_queue);
 }
 
+void test_ring_normal_use() {
+    ThreadPool_work_ring_t *work_ring = ThreadPool_work_ring_create(3);
+    assert(ThreadPool_work_ring_empty(work_ring) == 1);
+
+    // push and pop past the capacity so the ring wraps around
+    for (int i = 0; i < 5; i++) {
+        bool pushed = ThreadPool_work_ring_push(work_ring, NULL, (void *) message[i]);
+        assert(pushed == 1);
+        ThreadPool_work_t work = ThreadPool_work_ring_pop(work_ring);
+        // assert first-in first-out
+        assert(work.arg == message[i]);
+        (void) pushed;
+        (void) work;
+    }
+
+    // assert empty
+    assert(ThreadPool_work_ring_empty(work_ring) == 1);
+    ThreadPool_work_ring_destroy(work_ring);
+}
+
+void test_ring_full() {
+    ThreadPool_work_ring_t *work_ring = ThreadPool_work_ring_create(3);
+
+    bool pushed;
+    for (int i = 0; i < 3; i++) {
+        pushed = ThreadPool_work_ring_push(work_ring, NULL, (void *) message[i]);
+        assert(pushed == 1);
+    }
+
+    // assert pushing to a full ring fails
+    assert(ThreadPool_work_ring_full(work_ring) == 1);
+    pushed = ThreadPool_work_ring_push(work_ring, NULL, (void *) message[3]);
+    assert(pushed == 0);
+
+    // assert popping frees a slot
+    ThreadPool_work_t work = ThreadPool_work_ring_pop(work_ring);
+    assert(work.arg == message[0]);
+    assert(ThreadPool_work_ring_full(work_ring) == 0);
+    pushed = ThreadPool_work_ring_push(work_ring, NULL, (void *) message[3]);
+    assert(pushed == 1);
+    (void) pushed;
+
+    for (int i = 1; i < 4; i++) {
+        work = ThreadPool_work_ring_pop(work_ring);
+        assert(work.arg == message[i]);
+    }
+    (void) work;
+
+    assert(ThreadPool_work_ring_empty(work_ring) == 1);
+    ThreadPool_work_ring_destroy(work_ring);
+}
+
 int main(int argc, char *argv[]) {
     fputs("Testing ThreadPool_work_queue: ", stdout);
     
     test_normal_use();
     test_delete_full();
+    test_ring_normal_use();
+    test_ring_full();
 
     fputs("Passed \n", stdout);
     return 0;
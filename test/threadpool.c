@@ -1,3 +1,6 @@
+// the tests rely on assert, which Release builds disable
+#undef NDEBUG
+
 #include <stdio.h>
 #include <assert.h>
 
@@ -44,6 +47,81 @@ void test_wait_between_work(int num_workers, int num_tasks) {
     assert(tasks_completed == 2 * num_tasks);
 }
 
+// holds a worker busy until the test opens the gate
+pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+int gate_entered = 0;
+int gate_open = 0;
+
+void mock_gated_work(void *args) {
+    pthread_mutex_lock(&mutex);
+    gate_entered = 1;
+    pthread_cond_broadcast(&gate_cond);
+    while (!gate_open) {
+        pthread_cond_wait(&gate_cond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    mock_work(args);
+}
+
+void test_bounded(int num_workers, int capacity, int num_tasks) {
+    tasks_completed = 0;
+    ThreadPool_t *threadpool = ThreadPool_create_bounded(num_workers, capacity, true);
+
+    // blocks while the queue is full instead of growing it
+    int added = 0;
+    for (int i = 0; i < num_tasks; i++) {
+        added += ThreadPool_add_work(threadpool, mock_work, NULL);
+    }
+    assert(added == num_tasks);
+
+    ThreadPool_destroy(threadpool);
+    assert(tasks_completed == num_tasks);
+}
+
+void test_bounded_fail_fast(int capacity) {
+    tasks_completed = 0;
+    gate_entered = 0;
+    gate_open = 0;
+    ThreadPool_t *threadpool = ThreadPool_create_bounded(1, capacity, false);
+
+    // wait until the single worker is held by the gate
+    ThreadPool_add_work(threadpool, mock_gated_work, NULL);
+    pthread_mutex_lock(&mutex);
+    while (!gate_entered) {
+        pthread_cond_wait(&gate_cond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    // the queue is empty and nothing is popped, so exactly capacity tasks fit
+    int added = 0;
+    for (int i = 0; i < capacity + 8; i++) {
+        added += ThreadPool_add_work(threadpool, mock_work, NULL);
+    }
+    assert(added == capacity);
+
+    pthread_mutex_lock(&mutex);
+    gate_open = 1;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&mutex);
+
+    ThreadPool_destroy(threadpool);
+    assert(tasks_completed == added + 1);
+}
+
+void test_batch(int num_workers, int capacity, int num_tasks) {
+    tasks_completed = 0;
+    void **args = calloc(num_tasks, sizeof(void *));
+    ThreadPool_t *threadpool = ThreadPool_create_bounded(num_workers, capacity, true);
+
+    int added = ThreadPool_add_work_batch(threadpool, mock_work, args, num_tasks);
+    assert(added == num_tasks);
+    (void) added;
+
+    ThreadPool_destroy(threadpool);
+    assert(tasks_completed == num_tasks);
+    free(args);
+}
+
 int main(int argc, char *argv[]) {
     fputs("Testing ThreadPool: ", stdout);
     pthread_mutex_init(&mutex, NULL);
@@ -55,6 +133,12 @@ int main(int argc, char *argv[]) {
     test_threadpool(256, 64);
     test_wait_between_work(8, 256);
     test_wait_between_work(8, 1);
+    test_bounded(1, 1, 64);
+    test_bounded(8, 16, 128 * 1024);
+    test_bounded_fail_fast(4);
+    test_batch(8, 0, 128 * 1024);
+    test_batch(8, 16, 128 * 1024);
+    test_batch(256, 1, 64);
 
     pthread_mutex_destroy(&mutex);
     fputs("Passed \n", stdout);